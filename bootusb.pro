@@ -10,6 +10,29 @@ SOURCES += \
     src/usb_detect.cpp \
     src/format.cpp \
     src/write_iso.cpp \
+    src/uring_engine.cpp \
+    src/buffer_pool.cpp \
+    src/io_util.cpp \
+    src/pipeline_engine.cpp \
+    src/io_sched.cpp \
+    src/autotune.cpp \
+    src/memscan.cpp \
+    src/sparse_write.cpp \
+    src/delta_write.cpp \
+    src/sha256.cpp \
+    src/write_journal.cpp \
+    src/bad_sectors.cpp \
+    src/removal_watch.cpp \
+    src/job_control.cpp \
+    src/block_stats.cpp \
+    src/mapped_source.cpp \
+    src/numa_place.cpp \
+    src/image_cache.cpp \
+    src/image_digest.cpp \
+    src/readback.cpp \
+    src/trail_verify.cpp \
+    src/quick_verify.cpp \
+    src/hash_manifest.cpp \
     src/bootloader.cpp
 
 HEADERS += \
@@ -17,6 +40,30 @@ HEADERS += \
     include/format.h \
     include/usb_detect.h \
     include/write_iso.h \
+    include/uring_engine.h \
+    include/buffer_pool.h \
+    include/io_util.h \
+    include/spsc_ring.h \
+    include/pipeline_engine.h \
+    include/io_sched.h \
+    include/autotune.h \
+    include/memscan.h \
+    include/sparse_write.h \
+    include/delta_write.h \
+    include/sha256.h \
+    include/write_journal.h \
+    include/bad_sectors.h \
+    include/removal_watch.h \
+    include/job_control.h \
+    include/block_stats.h \
+    include/mapped_source.h \
+    include/numa_place.h \
+    include/image_cache.h \
+    include/image_digest.h \
+    include/readback.h \
+    include/trail_verify.h \
+    include/quick_verify.h \
+    include/hash_manifest.h \
     include/gui.h
 
 INCLUDEPATH += include
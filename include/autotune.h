@@ -0,0 +1,52 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <string>
+#include <chrono>
+
+// Picks chunk size and queue depth while a write is running. Throughput is
+// measured over windows of completed writes; the chunk size doubles while it
+// keeps paying off, then queue depth grows by one while it keeps paying off
+// and per-write latency grows no faster than throughput.
+// A step that does not help is backed out (halving the chunk, or returning
+// the depth to the best seen) and the tuner moves on. After at most
+// settle_budget bytes it locks in the best setting it measured.
+class ChunkTuner {
+public:
+    ChunkTuner(const std::string &label, size_t min_chunk, size_t max_chunk, unsigned max_depth);
+
+    size_t chunk() const { return chunk_; }
+    unsigned depth() const { return depth_; }
+    size_t max_chunk() const { return max_chunk_; }
+    unsigned max_depth() const { return max_depth_; }
+    bool settled() const { return phase_ == SETTLED; }
+
+    // Report one completed write of bytes that took latency seconds
+    void record(size_t bytes, double latency);
+
+private:
+    enum Phase { GROW_CHUNK, GROW_DEPTH, SETTLED };
+
+    void evaluate(double throughput, double latency);
+    void settle(const char *reason);
+
+    std::string label_;
+    size_t min_chunk_, max_chunk_;
+    unsigned max_depth_;
+    size_t chunk_;
+    unsigned depth_ = 1;
+    Phase phase_ = GROW_CHUNK;
+
+    size_t best_chunk_;
+    unsigned best_depth_ = 1;
+    double best_throughput_ = 0;
+    double best_latency_ = 0;
+
+    size_t tuned_bytes_ = 0;
+    size_t window_bytes_ = 0;
+    size_t window_writes_ = 0;
+    double window_latency_ = 0;
+    std::chrono::steady_clock::time_point window_start_;
+};
+
+#endif // AUTOTUNE_H
@@ -0,0 +1,37 @@
+#ifndef BAD_SECTORS_H
+#define BAD_SECTORS_H
+
+#include <cstddef>
+#include <map>
+#include <utility>
+#include <vector>
+#include "io_util.h"
+
+// Error-tolerant writes: a chunk that fails with a media error is bisected
+// down to the logical block size, each failing block is retried a few times
+// with backoff, and blocks that keep failing are recorded and skipped. The
+// healthy parts of a chunk still go out in as few writes as possible.
+class RetryWriter {
+public:
+    RetryWriter(size_t block, ChunkSink inner) : block_(block), inner_(inner) {}
+
+    // False on a non-media error or once too many blocks have failed
+    bool write(const char *buf, size_t len, size_t offset);
+
+    // Coalesced (offset, length) byte ranges that could not be written
+    std::vector<std::pair<size_t, size_t>> bad_ranges() const;
+
+    void report() const;
+
+private:
+    bool write_range(const char *buf, size_t len, size_t offset);
+    void mark_bad(size_t offset, size_t len);
+
+    size_t block_;
+    ChunkSink inner_;
+    std::map<size_t, size_t> bad_;   // start -> end, non-overlapping, non-adjacent
+    size_t bad_blocks_ = 0;
+    size_t retried_ = 0;
+};
+
+#endif // BAD_SECTORS_H
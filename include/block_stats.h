@@ -0,0 +1,34 @@
+#ifndef BLOCK_STATS_H
+#define BLOCK_STATS_H
+
+#include <cstddef>
+#include <chrono>
+
+// Write progress as the device sees it: sectors completed according to
+// /sys/dev/block/<major>:<minor>/stat, rather than bytes handed to write().
+// Targets without block statistics (regular files) use a caller-supplied
+// estimate instead.
+class CompletionMeter {
+public:
+    explicit CompletionMeter(int fd);
+    ~CompletionMeter();
+    CompletionMeter(const CompletionMeter &) = delete;
+    CompletionMeter &operator=(const CompletionMeter &) = delete;
+
+    bool active() const { return stat_fd_ >= 0; }
+
+    // Bytes written by the device since construction; fallback when inactive
+    size_t completed(size_t fallback);
+
+    // Smoothed completion rate in bytes/s, 0 until there are two samples
+    double rate() const { return rate_; }
+
+private:
+    int stat_fd_ = -1;
+    unsigned long long base_sectors_ = 0;
+    size_t last_bytes_ = 0;
+    std::chrono::steady_clock::time_point last_time_;
+    double rate_ = 0;
+};
+
+#endif // BLOCK_STATS_H
@@ -3,7 +3,10 @@
 
 #include <string>
 
-bool install_syslinux(const std::string &usb_device);
-bool install_grub(const std::string &usb_device, const std::string &mount_point);
+class CancelToken;
+
+// cancel: optional, stops the installer when cancelled
+bool install_syslinux(const std::string &usb_device, const CancelToken *cancel = nullptr);
+bool install_grub(const std::string &usb_device, const std::string &mount_point, const CancelToken *cancel = nullptr);
 
 #endif // BOOTLOADER_H
\ No newline at end of file
@@ -0,0 +1,33 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+
+// Process-wide pool of page-aligned I/O buffers, suitable for O_DIRECT.
+// Buffers are backed by hugepages when the size allows and the system has
+// them, otherwise by transparent-hugepage-advised anonymous memory. Sizes are
+// rounded up to a power of two, and released buffers are kept for reuse up to
+// a cap, so repeated jobs do not allocate or memset and the pool stays bounded.
+// Reuse stays within the NUMA node of the acquiring thread's CPU, so a job
+// pinned to its target's node gets buffers from that node.
+char *buffer_pool_acquire(size_t size);
+void buffer_pool_release(char *buf, size_t size);
+
+// RAII handle for a pooled buffer
+class PoolBuffer {
+public:
+    explicit PoolBuffer(size_t size) : buf_(buffer_pool_acquire(size)), size_(size) {}
+    ~PoolBuffer() { if (buf_) buffer_pool_release(buf_, size_); }
+    PoolBuffer(const PoolBuffer &) = delete;
+    PoolBuffer &operator=(const PoolBuffer &) = delete;
+
+    char *data() const { return buf_; }
+    size_t size() const { return size_; }
+    explicit operator bool() const { return buf_ != nullptr; }
+
+private:
+    char *buf_;
+    size_t size_;
+};
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,25 @@
+#ifndef DELTA_WRITE_H
+#define DELTA_WRITE_H
+
+#include <cstddef>
+#include "io_util.h"
+
+// Delta reflash: reads what the target already holds at each chunk's offset
+// and passes only the runs that differ on to the next sink. USB reads are
+// much cheaper than writes, and unchanged blocks cost the flash nothing.
+class DeltaWriter {
+public:
+    // rfd: the target opened for reading (with O_DIRECT if writes use it)
+    DeltaWriter(int rfd, ChunkSink inner) : rfd_(rfd), inner_(inner) {}
+
+    bool write(const char *buf, size_t len, size_t offset);
+
+    size_t unchanged() const { return unchanged_; }
+
+private:
+    int rfd_;
+    ChunkSink inner_;
+    size_t unchanged_ = 0;
+};
+
+#endif // DELTA_WRITE_H
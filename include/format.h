@@ -3,8 +3,11 @@
 
 #include <string>
 
+class CancelToken;
+
 // device: e.g. /dev/sdb1 or /dev/sdb
 // fs_type: "vfat", "ntfs", "ext4"
-bool format_usb(const std::string &device, const std::string &fs_type = "vfat");
+// cancel: optional, stops parted/mkfs when cancelled
+bool format_usb(const std::string &device, const std::string &fs_type = "vfat", const CancelToken *cancel = nullptr);
 
 #endif // FORMAT_H
\ No newline at end of file
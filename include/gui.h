@@ -15,13 +15,19 @@
 #include <QTextEdit>
 #include <QRadioButton>
 #include <QCheckBox>
+#include <QSpinBox>
 #include <functional>
+#include <atomic>
+#include "job_control.h"
 
 class WorkerThread : public QThread {
     Q_OBJECT
 public:
     std::function<void(std::function<void(size_t,size_t)>)> job;
     std::function<void(size_t,size_t)> progressCb;
+    CancelToken cancel;
+    PauseToken pause;
+    bool succeeded = false;
 
     void run() override;
 };
@@ -35,6 +41,8 @@ private slots:
     void onRefreshDevices();
     void onBrowseISO();
     void onStart();
+    void onPause();
+    void onCancel();
     void onProgressUpdate();
     void onOperationComplete();
 
@@ -69,6 +77,8 @@ private:
     QLineEdit *volumeLabelEdit;
     
     QPushButton *startBtn;
+    QPushButton *pauseBtn;
+    QPushButton *cancelBtn;
     QProgressBar *progressBar;
     QLabel *statusLabel;
     
@@ -79,6 +89,10 @@ private:
     QCheckBox *checkBadBlocksCheck;
     QCheckBox *persistentCheck;
     QComboBox *persistentSizeCombo;
+    QComboBox *ioClassCombo;
+    QSpinBox *ioLevelSpin;
+    QSpinBox *bandwidthCapSpin;
+    QSpinBox *imageCacheSpin;
     
     // Logs
     QTextEdit *logText;
@@ -87,7 +101,10 @@ private:
     QString selectedIsoPath;
     bool isRunning;
     QTimer *progressTimer;
-    int progressValue;
+    // Written by the worker, shown by progressTimer on the GUI thread
+    std::atomic<int> progressValue;
+    std::atomic<int> flushRemainingMb;   // -1 outside the flush phase
+    std::atomic<int> flushEtaSec;        // -1 while unknown
     
     // Worker
     WorkerThread *workerThread;
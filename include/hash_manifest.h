@@ -0,0 +1,44 @@
+#ifndef HASH_MANIFEST_H
+#define HASH_MANIFEST_H
+
+#include <string>
+#include <vector>
+#include "image_digest.h"
+
+// Merkle tree over the block digests of an image. The leaves are the
+// ImageDigest blocks, a parent is SHA-256(0x01 || left || right) and the odd
+// node at the end of a level moves up unchanged. A write saves the tree of
+// its image next to the job record, and a repair compares it with the tree
+// of what the stick reads back to find the blocks to rewrite.
+class HashManifest {
+public:
+    using Digest = ImageDigest::Digest;
+    static const size_t BLOCK = ImageDigest::BLOCK;
+
+    HashManifest() = default;
+    // digest has to be complete
+    explicit HashManifest(const ImageDigest &digest);
+
+    size_t total() const { return total_; }
+    size_t blocks() const { return levels_.empty() ? 0 : levels_[0].size(); }
+    const Digest &block(size_t index) const { return levels_[0][index]; }
+    std::string root_hex() const;
+
+    // Indexes of the blocks whose digests differ from other's, found by
+    // descending only into subtrees whose hashes differ. nodes, if given,
+    // receives the number of tree nodes compared.
+    std::vector<size_t> differing_blocks(const HashManifest &other, size_t *nodes = nullptr) const;
+
+    // Only the leaves are stored; load() rebuilds the tree and rejects a
+    // file whose root does not match the one it recorded
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+
+private:
+    void build(std::vector<Digest> leaves);
+
+    size_t total_ = 0;
+    std::vector<std::vector<Digest>> levels_;  // leaves first, the root level last
+};
+
+#endif // HASH_MANIFEST_H
@@ -0,0 +1,44 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <string>
+#include <cstddef>
+#include <functional>
+
+// Process-wide cache of whole images in locked memory, for stations that
+// flash the same ISO over and over. Each image is loaded once into a memfd
+// (hugetlb-backed when the system has hugepages reserved) and write and
+// verify jobs read that copy instead of the disk. Images are evicted least
+// recently used first when a new one does not fit the budget. A load only
+// holds up other jobs for the same image.
+
+// Memory budget in bytes, counting hugetlb copies at their hugepage-rounded
+// size; 0 (the default) disables the cache and drops everything in it. The
+// GUI sets it from its "Image cache" setting.
+void image_cache_set_budget(size_t bytes);
+
+// A new fd reading the cached copy of path, loading it first on a miss.
+// -1 when the cache is disabled, the image is larger than the budget or
+// loading fails; callers then read path as usual. The copy is only cached
+// for the file's current size and mtime. An fd stays valid after its image
+// is evicted, and the memory is freed when the last such fd is closed.
+// Reads must stop at the image size: a hugetlb copy is padded to whole
+// hugepages, so the fd's own size may be larger. should_stop is polled
+// between chunks of a load and every 50ms while waiting for another job's
+// load of the same image; true gives up with -1.
+int image_cache_open(const std::string &path, std::function<bool()> should_stop = nullptr);
+
+struct ImageCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;       // loads, including reloads of modified images
+    size_t evictions = 0;
+    size_t images = 0;       // currently cached
+    size_t bytes = 0;        // memory held by the cached images
+    size_t locked_bytes = 0; // of which locked into RAM
+    size_t budget = 0;
+};
+ImageCacheStats image_cache_stats();
+// One log line with the counters above; nothing while the cache is off
+void image_cache_log_stats();
+
+#endif // IMAGE_CACHE_H
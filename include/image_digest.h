@@ -0,0 +1,46 @@
+#ifndef IMAGE_DIGEST_H
+#define IMAGE_DIGEST_H
+
+#include <array>
+#include <vector>
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include "sha256.h"
+
+// SHA-256 of every BLOCK of an image, computed while the image streams to
+// the target, so verification only has to read the device back. The image
+// digest is the SHA-256 of the block digests in order.
+class ImageDigest {
+public:
+    static const size_t BLOCK = 4 * 1024 * 1024;
+    using Digest = std::array<uint8_t, 32>;
+
+    explicit ImageDigest(size_t total) : total_(total), blocks_((total + BLOCK - 1) / BLOCK) {}
+
+    // Data has to arrive in order; a gap or overlap leaves the digest
+    // incomplete, and callers fall back to comparing against the image
+    void update(const char *buf, size_t len, size_t offset);
+
+    // Every byte of the image has been seen exactly once
+    bool complete() const { return !broken_ && seen_ == total_; }
+
+    size_t total() const { return total_; }
+    const std::vector<Digest> &blocks() const { return blocks_; }
+
+    // Digest of block index once it has been computed; safe to call from
+    // another thread while update() runs
+    bool block(size_t index, Digest &out) const;
+    std::string image_hex() const;
+
+private:
+    size_t total_;
+    size_t seen_ = 0;
+    bool broken_ = false;
+    Sha256 current_;
+    std::vector<Digest> blocks_;
+    std::atomic<size_t> ready_{0};
+};
+
+#endif // IMAGE_DIGEST_H
@@ -0,0 +1,38 @@
+#ifndef IO_SCHED_H
+#define IO_SCHED_H
+
+#include <cstddef>
+#include <chrono>
+
+// I/O priority classes, matching the kernel's IOPRIO_CLASS_* values
+enum {
+    IO_CLASS_DEFAULT = 0,
+    IO_CLASS_REALTIME = 1,
+    IO_CLASS_BEST_EFFORT = 2,
+    IO_CLASS_IDLE = 3
+};
+
+// Encoded ioprio value for io_class/level, 0 for "leave as is"
+unsigned short io_priority_value(int io_class, int level);
+
+// Set the calling thread's I/O priority; threads it creates afterwards
+// inherit it. Returns the previous value so it can be restored, or -1.
+int set_thread_io_priority(unsigned short ioprio);
+
+// Paces a byte stream to a fixed rate. consume() sleeps just long enough to
+// keep the stream on its schedule, with at most burst bytes of slack, so the
+// output is an even trickle rather than full-speed bursts and long pauses.
+class TokenBucket {
+public:
+    TokenBucket(double bytes_per_sec, size_t burst);
+    void consume(size_t bytes);
+    bool active() const { return rate_ > 0; }
+
+private:
+    double rate_;
+    double burst_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_;
+};
+
+#endif // IO_SCHED_H
@@ -0,0 +1,28 @@
+#ifndef IO_UTIL_H
+#define IO_UTIL_H
+
+#include <cstddef>
+#include <functional>
+#include <sys/types.h>
+
+// Writes len bytes of the image at offset; returns false with errno set on failure.
+// Engines that see the data in user space hand each chunk to one of these.
+using ChunkSink = std::function<bool(const char *buf, size_t len, size_t offset)>;
+
+// read() until len bytes are in buf or EOF; returns bytes read or -1
+ssize_t read_full(int fd, char *buf, size_t len);
+
+// write() all len bytes, retrying short writes; returns false on error
+bool write_full(int fd, const char *buf, size_t len);
+
+// pwrite() all len bytes at offset, retrying short writes; returns false on error
+bool pwrite_full(int fd, const char *buf, size_t len, size_t offset);
+
+// Logical block size O_DIRECT transfers must be aligned to
+size_t logical_block_size(int fd);
+
+// Bytes of [offset, offset + len) of a readable fd currently in the page
+// cache, via mincore() on a throwaway mapping; -1 if it cannot be sampled
+ssize_t resident_bytes(int fd, size_t offset, size_t len);
+
+#endif // IO_UTIL_H
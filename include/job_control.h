@@ -0,0 +1,49 @@
+#ifndef JOB_CONTROL_H
+#define JOB_CONTROL_H
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+// Cooperative cancellation. The UI thread calls cancel(); a job polls
+// cancelled() between chunks and while it waits on I/O, and gives up as
+// soon as it sees the flag.
+class CancelToken {
+public:
+    void cancel();
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+    // Milliseconds since cancel() was called
+    long long since_cancel_ms() const;
+
+private:
+    std::atomic<bool> cancelled_{false};
+    std::atomic<long long> cancelled_at_{0};
+};
+
+// Cooperative pause. A paused job blocks in wait() at its next chunk
+// boundary with its buffers and device handle still open, so resuming
+// costs nothing.
+class PauseToken {
+public:
+    void pause();
+    void resume();
+    bool paused() const { return paused_.load(std::memory_order_relaxed); }
+
+    // Blocks while paused; returns false once cancel (if any) is cancelled
+    bool wait(const CancelToken *cancel);
+
+private:
+    std::atomic<bool> paused_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+// Runs cmd through /bin/sh like system(), but kills the command's process
+// group if cancel is cancelled while it runs. Returns the wait status as
+// system() does, or -1 if the command could not run or was cancelled.
+int run_command(const std::string &cmd, const CancelToken *cancel);
+
+#endif // JOB_CONTROL_H
@@ -0,0 +1,70 @@
+#ifndef MAPPED_SOURCE_H
+#define MAPPED_SOURCE_H
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <sys/types.h>
+#include "io_util.h"
+
+class ChunkTuner;
+
+// Read-only shared mapping of a whole image file. Jobs that open the same
+// file at the same time get the same mapping, so its pages are faulted in
+// once for all of them.
+class MappedImage {
+public:
+    // Maps the first size bytes of the file open at fd; nullptr if it cannot
+    // be mapped. The fd is not kept and may be closed afterwards.
+    static std::shared_ptr<MappedImage> open(int fd, size_t size);
+    ~MappedImage();
+    MappedImage(const MappedImage &) = delete;
+    MappedImage &operator=(const MappedImage &) = delete;
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // Start readahead for [offset, offset + len)
+    void will_need(size_t offset, size_t len) const;
+    // Keep readahead a fixed distance in front of a sequential reader at
+    // cursor; prefetched tracks how far it has been issued so far
+    void read_ahead(size_t cursor, size_t &prefetched) const;
+    // Touch every page of [offset, offset + len); false if that faults (the
+    // file was truncated or its storage failed) instead of taking the process
+    // down with SIGBUS. Callers check a range before reading it from data().
+    bool fault_in(size_t offset, size_t len) const;
+    // Unmap [offset, offset + len) from this process so its pages can be
+    // dropped; a no-op for a cached image, whose pages stay in memory anyway
+    void done_with(size_t offset, size_t len) const;
+
+private:
+    MappedImage(const char *data, size_t size, size_t map_size, size_t page, bool in_memory)
+        : data_(data), size_(size), map_size_(map_size), page_(page), in_memory_(in_memory) {}
+    void advise(size_t offset, size_t len, int advice) const;
+
+    const char *data_;
+    size_t size_;
+    size_t map_size_;   // size rounded up to page_, what was mapped
+    size_t page_;       // page size of the backing file, a hugepage for a hugetlb memfd
+    bool in_memory_;    // backed by a memfd from the image cache
+};
+
+// Page faults taken by the calling thread between construction and faults()
+class FaultCounter {
+public:
+    FaultCounter();
+    void faults(long &major, long &minor) const;
+
+private:
+    long major_ = 0;
+    long minor_ = 0;
+};
+
+// Hand length bytes of image starting at start to sink straight from the
+// mapping, chunk_size at a time, keeping readahead ahead of the writer.
+// Sink offsets are relative to start. drop_behind unmaps consumed chunks.
+bool mapped_copy(const MappedImage &image, const ChunkSink &sink, size_t start, size_t length, size_t chunk_size,
+                 std::function<void(size_t, size_t)> progress_callback, ChunkTuner *tuner = nullptr,
+                 bool drop_behind = false);
+
+#endif // MAPPED_SOURCE_H
@@ -0,0 +1,26 @@
+#ifndef MEMSCAN_H
+#define MEMSCAN_H
+
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+// True if all len bytes at p are zero. Vectorized; stops at the first
+// non-zero 64-byte block, so data-bearing chunks are rejected almost at once.
+bool is_zero(const char *p, size_t len);
+
+// (offset, length) byte ranges
+using ByteRanges = std::vector<std::pair<size_t, size_t>>;
+
+// Compares len bytes at a and b and appends every range where they differ to
+// out, offset by base. A range starting within merge_gap bytes of the end of
+// the previous one in out extends it instead. Returns true if the buffers
+// are equal. Uses the widest of AVX-512, AVX2 and SSE2 the CPU supports,
+// chosen at runtime; equal stretches run at memory bandwidth.
+bool compare_ranges(const char *a, const char *b, size_t len, ByteRanges &out, size_t base = 0,
+                    size_t merge_gap = 0);
+
+// Name of the kernel compare_ranges uses on this CPU
+const char *compare_kernel();
+
+#endif // MEMSCAN_H
@@ -0,0 +1,35 @@
+#ifndef NUMA_PLACE_H
+#define NUMA_PLACE_H
+
+#include <string>
+#include <sched.h>
+
+// NUMA node of the host controller behind block device fd, found by walking
+// its sysfs device path up to the first ancestor with a numa_node attribute.
+// -1 if unknown, e.g. for regular files or on machines without NUMA.
+// controller, if given, receives the name of that ancestor (a PCI address).
+int device_numa_node(int fd, std::string *controller = nullptr);
+
+// Pins the calling thread to the CPUs of the target's NUMA node and makes
+// that node preferred for its new memory, for the lifetime of a job. Threads
+// created meanwhile inherit both. Does nothing on single-node machines, when
+// the node is unknown or when disabled; every decision is logged.
+class NodePlacement {
+public:
+    NodePlacement(int fd, bool enabled);
+    ~NodePlacement();
+    NodePlacement(const NodePlacement &) = delete;
+    NodePlacement &operator=(const NodePlacement &) = delete;
+
+    int node() const { return node_; }
+
+private:
+    int node_ = -1;
+    bool pinned_ = false;
+    cpu_set_t previous_cpus_;
+    bool policy_set_ = false;
+    int previous_policy_ = 0;
+    unsigned long previous_nodes_[16] = {};
+};
+
+#endif // NUMA_PLACE_H
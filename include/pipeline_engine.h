@@ -0,0 +1,32 @@
+#ifndef PIPELINE_ENGINE_H
+#define PIPELINE_ENGINE_H
+
+#include <string>
+#include <functional>
+#include "io_util.h"
+
+class ChunkTuner;
+
+// Ring occupancy observed by the writer over a pipeline run. A ring that is
+// mostly full means the device is the bottleneck; mostly empty means the source.
+struct PipelineStats {
+    size_t capacity = 0;
+    double avg_occupancy = 0.0;
+    size_t writer_waits = 0;   // writer found the ring empty (source-bound)
+    size_t reader_waits = 0;   // reader found no free buffer (device-bound)
+};
+
+// Copy length bytes from ifd into sink with a reader thread filling a bounded
+// SPSC ring of ring_depth chunk buffers while the calling thread drains it
+// to the device. sink and progress_callback run on the calling thread.
+// should_stop is polled while the writer waits for data; true ends the copy.
+// on_read, if set, sees each chunk on the reader thread, in order, before it
+// is queued; returning false ends the copy as a read error.
+// With a tuner, chunk_size is the ceiling: the writer hands each ring buffer
+// to sink in pieces of the tuner's current chunk and reports their latency.
+bool pipeline_copy(int ifd, const ChunkSink &sink, size_t length, size_t chunk_size, unsigned ring_depth,
+                   std::function<void(size_t, size_t)> progress_callback,
+                   PipelineStats *stats = nullptr, std::function<bool()> should_stop = nullptr,
+                   ChunkSink on_read = nullptr, ChunkTuner *tuner = nullptr);
+
+#endif // PIPELINE_ENGINE_H
@@ -0,0 +1,32 @@
+#ifndef QUICK_VERIFY_H
+#define QUICK_VERIFY_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <cstdint>
+
+class CancelToken;
+
+// What a sampled verification checked and what it allows concluding
+struct QuickVerifyResult {
+    uint64_t seed = 0;           // reproduces the sample
+    size_t blocks = 0;           // blocks in the image
+    size_t boot_blocks = 0;      // always checked: boot areas and partition tables
+    size_t sampled = 0;          // random blocks checked on top of those
+    double corrupt_bound = 1.0;  // with no mismatch: the corrupt fraction of blocks is below this at the target confidence
+    std::vector<std::pair<size_t, size_t>> mismatches;  // (offset, length) extents that differ
+};
+
+// Reads back a seeded random sample of BLOCK-sized blocks of the image plus
+// the boot areas (the first and last MB, MBR/GPT partition starts and the El
+// Torito boot catalog and image) and compares them with the source. The
+// sample is sized so that corruption of at least defect_fraction of the
+// blocks is caught with probability detect. seed 0 picks a fresh seed; the
+// one used is logged and returned so a run can be repeated.
+bool quick_verify(const std::string &iso_path, const std::string &usb_path, double detect, double defect_fraction,
+                  uint64_t seed, std::function<void(size_t, size_t)> progress_callback,
+                  const CancelToken *cancel = nullptr, QuickVerifyResult *result = nullptr);
+
+#endif // QUICK_VERIFY_H
@@ -0,0 +1,31 @@
+#ifndef READBACK_H
+#define READBACK_H
+
+#include <string>
+#include <functional>
+#include "io_util.h"
+
+// Largest chunk read_back() hands to its consumer
+const size_t READBACK_MAX_CHUNK = 4 * 1024 * 1024;
+// Granularity at which a chunk that failed to read is retried
+const size_t READBACK_SALVAGE_PIECE = 64 * 1024;
+
+// Writes back anything of the target still dirty and drops its cached
+// pages, so following reads come from the device
+void flush_and_drop(int fd);
+
+// Reads the first length bytes of the target at path back for verification
+// and hands them to consumer in offset order. The target's buffers are
+// flushed and its cached pages dropped first, and the reads use O_DIRECT
+// with a deep io_uring queue where possible, so the data comes from the
+// device rather than the host page cache. The method used is logged.
+// should_stop is polled between chunks; true ends the read.
+// Without unreadable, a read error ends the read. With it, a chunk that
+// fails is retried in READBACK_SALVAGE_PIECE pieces; pieces the device
+// cannot return are passed to unreadable as (offset, length), zero-filled,
+// and the read goes on, so a failing stick is mapped rather than abandoned.
+bool read_back(const std::string &path, size_t length, const ChunkSink &consumer,
+               std::function<bool()> should_stop = nullptr,
+               std::function<void(size_t, size_t)> unreadable = nullptr);
+
+#endif // READBACK_H
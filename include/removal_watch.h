@@ -0,0 +1,43 @@
+#ifndef REMOVAL_WATCH_H
+#define REMOVAL_WATCH_H
+
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+// Watches udev for the removal of a block device (or of the disk it is a
+// partition of) while a job runs. The engines poll removed() between I/Os,
+// so a pulled stick stops the job without waiting for every queued write
+// and the final flush to fail one by one in the kernel's error path.
+class RemovalWatch {
+public:
+    // Inactive if devnode is not a block device or udev is unavailable
+    explicit RemovalWatch(const std::string &devnode);
+    ~RemovalWatch();
+    RemovalWatch(const RemovalWatch &) = delete;
+    RemovalWatch &operator=(const RemovalWatch &) = delete;
+
+    bool active() const { return thread_.joinable(); }
+
+    // Set by the watcher thread as soon as the removal event arrives
+    const std::atomic<bool> &flag() const { return removed_; }
+    bool removed() const { return removed_.load(std::memory_order_acquire); }
+
+    // Milliseconds since the removal event arrived
+    long long since_removal_ms() const;
+
+private:
+    void run();
+
+    std::atomic<bool> removed_{false};
+    std::atomic<long long> removed_at_{0};   // steady_clock ms, published before removed_
+    std::thread thread_;
+    int stop_fd_ = -1;
+    struct udev *udev_ = nullptr;
+    struct udev_monitor *monitor_ = nullptr;
+    unsigned long long devnum_ = 0;   // the target
+    unsigned long long disknum_ = 0;  // its whole disk, same as devnum_ for a disk
+};
+
+#endif // REMOVAL_WATCH_H
@@ -0,0 +1,35 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Streaming SHA-256 (FIPS 180-4), using the CPU's SHA extensions when it
+// has them
+class Sha256 {
+public:
+    Sha256() { reset(); }
+
+    void reset();
+    void update(const void *data, size_t len);
+    void finish(uint8_t out[32]);
+
+    // One-shot helpers
+    static void digest(const void *data, size_t len, uint8_t out[32]);
+    static std::string hex(const uint8_t digest[32]);
+
+    // True when hashing runs on the SHA extensions, several times faster
+    // than the portable code
+    static bool accelerated();
+
+private:
+    void blocks(const uint8_t *p, size_t n);
+
+    uint32_t h_[8];
+    uint8_t buf_[64];
+    size_t buf_len_;
+    uint64_t total_;
+};
+
+#endif // SHA256_H
@@ -0,0 +1,46 @@
+#ifndef SPARSE_WRITE_H
+#define SPARSE_WRITE_H
+
+#include <cstddef>
+#include "io_util.h"
+
+// Sparse writes: all-zero runs of the image are not written as data. On a
+// regular file each zero run becomes a hole. On a block device it goes to
+// BLKZEROOUT, which the kernel offloads as WRITE ZEROES when the device
+// supports it.
+class SparseWriter {
+public:
+    // Data runs are passed on to out; fd is the target for clearing ranges
+    SparseWriter(int fd, ChunkSink out) : fd_(fd), out_(out) {}
+
+    // Pick the method for a target of total bytes; false if the target
+    // cannot be set up
+    bool prepare(size_t total);
+
+    // Write one chunk at offset, leaving out its zero runs
+    bool write(const char *buf, size_t len, size_t offset);
+
+    void report() const;
+
+private:
+    enum Method { ZERO_OUT, PUNCH };
+
+    bool clear_run(size_t offset, size_t len);
+
+    int fd_;
+    ChunkSink out_;
+    Method method_ = ZERO_OUT;
+    size_t zero_until_ = 0;   // zero runs below this may be handled without data
+    size_t block_ = 512;
+    size_t elided_ = 0;
+    bool offloaded_ = false;
+};
+
+// Sets up a regular file as the target of an image of image_size bytes: the
+// file spans target_size (at least the image), old contents are dropped
+// unless keep_contents, and for a fresh file the ranges holding data in the
+// source src_fd are preallocated so the written image is not fragmented.
+// Everything else stays a hole. False if the file cannot be sized.
+bool prepare_image_file(int fd, int src_fd, size_t image_size, size_t target_size, bool keep_contents);
+
+#endif // SPARSE_WRITE_H
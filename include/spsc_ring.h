@@ -0,0 +1,47 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+// Bounded lock-free single-producer/single-consumer ring. One thread may
+// call try_push(), one other thread may call try_pop(); size() is safe from
+// either side and is what the pipeline samples for its occupancy metric.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots_(capacity + 1) {}
+
+    bool try_push(const T &value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t next = (tail + 1) % slots_.size();
+        if (next == head_.load(std::memory_order_acquire)) return false;
+        slots_[tail] = value;
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &out) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) return false;
+        out = slots_[head];
+        head_.store((head + 1) % slots_.size(), std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        return (tail + slots_.size() - head) % slots_.size();
+    }
+
+    size_t capacity() const { return slots_.size() - 1; }
+
+private:
+    std::vector<T> slots_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+#endif // SPSC_RING_H
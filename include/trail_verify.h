@@ -0,0 +1,80 @@
+#ifndef TRAIL_VERIFY_H
+#define TRAIL_VERIFY_H
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "sha256.h"
+
+class ImageDigest;
+
+// Verifies the target while it is still being written. A thread reads back,
+// with O_DIRECT, what the writer has reported durable, once window bytes of
+// it are pending, and checks it against the image digest (or, without one,
+// the image itself). The first mismatch is recorded and failed() turns true
+// so the writer can stop.
+class TrailingVerifier {
+public:
+    // ifd: the image, read only when there is no digest
+    TrailingVerifier(const std::string &target, int ifd, size_t total, const ImageDigest *digest, size_t window,
+                     std::function<bool()> should_stop);
+    ~TrailingVerifier();
+    TrailingVerifier(const TrailingVerifier &) = delete;
+    TrailingVerifier &operator=(const TrailingVerifier &) = delete;
+
+    // Opens the target and starts the thread; false if that is not possible
+    bool start();
+
+    // Writer: everything below upto has reached the device
+    void durable(size_t upto);
+
+    // Writer: the whole image is flushed. Verifies the rest and waits for it;
+    // true if every byte matched.
+    bool finish();
+
+    // Ends the thread early, e.g. when the write failed
+    void stop();
+
+    bool failed() const { return failed_.load(); }
+    // Offset of the first mismatch: its digest block's, when checking by hash
+    size_t failed_at() const { return failed_at_; }
+    // The digest could not be used (it broke mid-write): verify afterwards
+    bool inconclusive() const { return inconclusive_; }
+    size_t verified() const { return verified_.load(); }
+
+private:
+    void run();
+    bool read_range(size_t offset, size_t length);
+    bool check(const char *buf, size_t len, size_t offset);
+    void fail(size_t offset);
+
+    std::string target_;
+    int ifd_;
+    size_t total_;
+    const ImageDigest *digest_;
+    size_t window_;
+    std::function<bool()> should_stop_;
+
+    int dfd_ = -1;
+    int fd_ = -1;
+    size_t block_size_ = 512;
+    bool use_uring_ = false;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t durable_ = 0;
+    bool finishing_ = false;
+    bool quit_ = false;
+
+    std::atomic<size_t> verified_{0};
+    std::atomic<bool> failed_{false};
+    size_t failed_at_ = 0;
+    bool inconclusive_ = false;
+    Sha256 hash_;
+    char *image_buf_ = nullptr;
+};
+
+#endif // TRAIL_VERIFY_H
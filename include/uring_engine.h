@@ -0,0 +1,43 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#include <string>
+#include <functional>
+#include "io_util.h"
+
+class ChunkTuner;
+
+// True if the running kernel lets us create an io_uring instance
+// (it may be missing or disabled via kernel.io_uring_disabled).
+bool uring_engine_available();
+
+// Copy total bytes from ifd to ofd starting at offset 0, keeping up to
+// queue_depth chunks of chunk_size in flight at once. Both fds are registered
+// with the ring and the chunk buffers are registered when RLIMIT_MEMLOCK
+// allows it, otherwise plain READ/WRITE ops are used on the same buffers.
+// progress_callback receives bytes_written, total_bytes as writes complete;
+// bytes_written is always a prefix of the image with every write below it
+// finished, even though chunks complete out of order.
+// ioprio, if non-zero, is attached to every request so the kernel's io-wq
+// workers honor the job's I/O priority too. With a tuner, chunk_size and
+// queue_depth are upper bounds and the tuner picks the values in use.
+// should_stop is polled at least every 50ms, also while waiting on in-flight
+// I/O; once it returns true no new I/O is queued and pending requests are
+// cancelled.
+bool uring_copy(int ifd, int ofd, size_t total, size_t chunk_size, unsigned queue_depth,
+                std::function<void(size_t, size_t)> progress_callback,
+                unsigned short ioprio = 0, ChunkTuner *tuner = nullptr,
+                std::function<bool()> should_stop = nullptr);
+
+// Read length bytes of fd starting at offset with up to queue_depth reads of
+// chunk_size in flight, handing each chunk to consumer in offset order on the
+// calling thread; consumer returning false ends the read. Buffers are pooled,
+// so fd may be opened with O_DIRECT when offset, chunk_size and length are
+// aligned. should_stop is polled at least every 50ms. On a read error every
+// chunk before the failed one still reaches consumer, and failed_at, if set,
+// receives the failed chunk's offset; it is left alone on any other failure.
+bool uring_read(int fd, size_t offset, size_t length, size_t chunk_size, unsigned queue_depth,
+                const ChunkSink &consumer, std::function<bool()> should_stop = nullptr,
+                size_t *failed_at = nullptr);
+
+#endif // URING_ENGINE_H
@@ -12,4 +12,10 @@ struct USBDevice {
 
 std::vector<USBDevice> list_usb_devices();
 
+// Vendor and model of the disk behind devnode, or "" if it is not a block device
+std::string device_model(const std::string &devnode);
+
+// Serial number of the disk behind devnode, or "" if udev does not know one
+std::string device_serial(const std::string &devnode);
+
 #endif // USB_DETECT_H
\ No newline at end of file
@@ -3,25 +3,119 @@
 
 #include <string>
 #include <functional>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+class CancelToken;
+class PauseToken;
 
 // iso_path: path to .iso file
 // usb_path: raw block device, e.g. /dev/sdb
-// progress_callback: optional lambda receiving bytes_written, total_bytes
+// progress_callback: optional lambda receiving bytes the device has completed, total_bytes
 bool write_iso_to_usb(const std::string &iso_path, const std::string &usb_path, std::function<void(size_t, size_t)> progress_callback = nullptr);
 
+// Filled in by write_iso_to_usb_advanced when a job finishes
+struct WriteReport {
+    size_t image_bytes = 0;    // size of the ISO
+    size_t device_bytes = 0;   // data actually written to the device
+    double elapsed_sec = 0;    // open to final flush, excluding verification
+    double handoff_sec = 0;    // open until the last byte was handed to the kernel
+    std::vector<std::pair<size_t, size_t>> bad_ranges;  // (offset, length) that could not be written
+    bool device_removed = false;  // the target disappeared mid-write
+    size_t removed_at = 0;        // bytes the engine had completed when it did
+    bool cancelled = false;       // stopped through WriteOptions::cancel
+    bool verify_failed = false;   // the trailing verifier found a mismatch and stopped the write
+    size_t mismatch_at = 0;       // offset of that mismatch
+    std::vector<std::pair<size_t, size_t>> mismatches;  // (offset, length) extents that failed verification
+    uint64_t quick_verify_seed = 0;  // seed of the WriteOptions::quick_verify sample, to repeat it
+    double corrupt_bound = 1.0;      // after a clean quick verify: corrupt fraction of blocks below this
+    long source_major_faults = 0; // page faults on the mapped image while writing (engine "mmap")
+    long source_minor_faults = 0;
+};
+
+// Snapshot passed to WriteOptions::status_callback while a job runs
+struct WriteProgress {
+    bool hashing = false;      // a resumed job hashing the prefix it skips; handed of total counts that phase
+    bool flushing = false;     // all data handed over, waiting for the device to drain it
+    size_t durable = 0;        // image bytes the device has completed
+    size_t handed = 0;         // image bytes handed to the kernel
+    size_t total = 0;          // image size
+    size_t pending = 0;        // handed over but not yet completed by the device
+    double mbps = 0;           // device completion rate
+    double eta_sec = -1;       // until the end of the current phase, -1 while unknown
+    size_t verified = 0;       // image bytes read back and checked while writing (WriteOptions::verify_window)
+};
+
+struct WriteOptions {
+    size_t buffer_size = 4 * 1024 * 1024;
+    bool verify_write = false;    // read the device back and check it against digests taken during the write
+    size_t verify_window = 0;     // with verify_write, read back while writing, in batches of this many durable
+                                  // bytes; 0 verifies after the final flush
+    bool quick_verify = false;    // without verify_write, read back a seeded random sample of blocks plus the
+                                  // boot areas and partition tables instead of the whole image
+    double quick_verify_detect = 0.99;     // probability of catching corruption of quick_verify_fraction
+    double quick_verify_fraction = 0.001;  // of the blocks; together they size the sample
+    uint64_t quick_verify_seed = 0;        // 0 for a fresh seed, otherwise repeats an earlier sample
+    std::string engine = "auto";  // "auto" (io_uring when available), "io_uring", "pipeline", "splice", "mmap" or "serial"
+    unsigned queue_depth = 0;     // chunks in flight (io_uring) or ring slots (pipeline), 0 for the default of 8
+    bool direct_io = false;       // write with O_DIRECT from pooled aligned buffers
+    size_t writeback_window = 128 * 1024 * 1024;  // max dirty bytes for buffered writes, 0 for O_SYNC
+    bool cache_neutral = false;   // drop source/device pages behind the cursor to spare the host page cache
+    int io_class = 0;             // ioprio class for the job's threads: 0 default, 1 realtime, 2 best-effort, 3 idle
+    int io_level = 4;             // ioprio level within the class, 0 (highest) to 7
+    double max_mbps = 0;          // throughput cap in MB/s, 0 for unlimited
+    bool autotune = false;        // adapt chunk size (and io_uring depth) to the device while writing
+    bool sparse = false;          // zero-out (or punch holes for) all-zero runs of the image instead of writing them
+    bool delta = false;           // read the target first and only write the runs that differ
+    bool hash_manifest = false;   // save a hash tree of the image with the job record so repair_usb() can fix the
+                                  // stick later; always saved when verify_write hashes the image anyway
+    bool resume = false;          // keep a journal of durable checkpoints and continue an interrupted write
+    bool tolerate_errors = false; // map blocks that fail to write instead of aborting on the first error
+    size_t target_size = 0;       // size of an image-file target, 0 for the image size; ignored for devices
+    bool numa_placement = true;   // pin the job's threads and buffers to the NUMA node of the target's controller
+    WriteReport *report = nullptr;  // optional, receives the job's statistics
+    const CancelToken *cancel = nullptr;  // optional, stops the job within 200ms
+    PauseToken *pause = nullptr;          // optional, holds the job between chunks
+    std::function<void(const WriteProgress &)> status_callback;  // optional, with every progress update
+};
+
 // Advanced version with configurable buffer size and verification
+// engine: "auto" (io_uring when available), "io_uring", "pipeline", "splice", "mmap" or "serial"
+// queue_depth: chunks in flight (io_uring) or ring slots (pipeline), 0 for the default of 8
 bool write_iso_to_usb_advanced(const std::string &iso_path, const std::string &usb_path, 
                               std::function<void(size_t, size_t)> progress_callback,
-                              size_t buffer_size, bool verify_write);
+                              size_t buffer_size, bool verify_write,
+                              const std::string &engine = "auto", unsigned queue_depth = 0);
 
-// Verify that the write was successful by comparing ISO and USB contents
+bool write_iso_to_usb_advanced(const std::string &iso_path, const std::string &usb_path, 
+                              std::function<void(size_t, size_t)> progress_callback,
+                              const WriteOptions &options);
+
+// Verify that the write was successful by comparing ISO and USB contents.
+// mismatches, if given, receives every (offset, length) extent that differs.
 bool verify_iso_write(const std::string &iso_path, const std::string &usb_path, 
-                     std::function<void(size_t, size_t)> progress_callback);
+                     std::function<void(size_t, size_t)> progress_callback,
+                     const CancelToken *cancel = nullptr, PauseToken *pause = nullptr,
+                     std::vector<std::pair<size_t, size_t>> *mismatches = nullptr);
+
+// Repair a stick written earlier from iso_path: read it back, compare its
+// hash tree with the manifest that write saved (WriteOptions::hash_manifest)
+// and rewrite only the blocks that differ or cannot be read. Fails without a
+// manifest for this image and device. repaired, if given, receives the
+// (offset, length) ranges rewritten.
+// The whole device is still read and hashed to find the damage, so a repair
+// takes about as long as a verify; it saves the rewrite, not the readback.
+bool repair_usb(const std::string &iso_path, const std::string &usb_path,
+                std::function<void(size_t, size_t)> progress_callback,
+                const CancelToken *cancel = nullptr,
+                std::vector<std::pair<size_t, size_t>> *repaired = nullptr);
 
 // Create persistent storage partition for live USB
 bool create_persistent_storage(const std::string &usb_path, size_t size_gb);
 
 // Advanced bootloader installation with type selection
-bool install_bootloader_advanced(const std::string &usb_path, const std::string &bootloader_type);
+bool install_bootloader_advanced(const std::string &usb_path, const std::string &bootloader_type,
+                                 const CancelToken *cancel = nullptr);
 
 #endif // WRITE_ISO_H
\ No newline at end of file
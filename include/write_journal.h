@@ -0,0 +1,50 @@
+#ifndef WRITE_JOURNAL_H
+#define WRITE_JOURNAL_H
+
+#include <string>
+#include <cstddef>
+
+// Resume journal for interrupted writes. One small file per (image, device)
+// under ~/.cache/bootusb/journal records the last offset known to be durable
+// on the device, plus SHA-256 hashes of the chunks just before it. A later
+// run re-hashes that tail on both the device and the image and, if it still
+// matches, continues from the checkpoint instead of from zero.
+// Path of a per-(image, device) record under the journal directory, ending
+// in suffix; the directory is created on demand
+std::string job_record_path(const std::string &iso_path, const std::string &device_id, size_t image_size,
+                            long long image_mtime, const std::string &suffix);
+
+class WriteJournal {
+public:
+    WriteJournal(const std::string &iso_path, const std::string &device_id, size_t image_size, long long image_mtime);
+
+    // Offset a new write can start from, 0 if there is no usable checkpoint.
+    // ifd is the image; device_path is reopened uncached for the tail check.
+    size_t resume_point(int ifd, const std::string &device_path);
+
+    // True once offset has passed the next checkpoint
+    bool due(size_t offset) const { return offset >= next_checkpoint_; }
+
+    // Persist durable as confirmed on the device (the caller has flushed it),
+    // hashing the image just below it from ifd for the next run's tail check
+    bool checkpoint(int ifd, size_t durable);
+
+    // The write finished; the journal is no longer needed
+    void complete();
+
+private:
+    struct ChunkHash {
+        size_t offset;
+        size_t len;
+        std::string sha;
+    };
+
+    std::string path_;
+    std::string iso_path_;
+    std::string device_id_;
+    size_t image_size_;
+    long long image_mtime_;
+    size_t next_checkpoint_;
+};
+
+#endif // WRITE_JOURNAL_H
@@ -0,0 +1,85 @@
+#include "autotune.h"
+#include <iostream>
+#include <algorithm>
+
+// Lock in the best setting once this much has been written
+static const size_t SETTLE_BUDGET = 384ull * 1024 * 1024;
+// A step must beat the best throughput by this much to count as progress
+static const double MIN_GAIN = 1.05;
+
+ChunkTuner::ChunkTuner(const std::string &label, size_t min_chunk, size_t max_chunk, unsigned max_depth)
+    : label_(label.empty() ? "unknown device" : label),
+      min_chunk_(min_chunk), max_chunk_(std::max(min_chunk, max_chunk)),
+      max_depth_(std::max(1u, max_depth)), chunk_(min_chunk), best_chunk_(min_chunk),
+      window_start_(std::chrono::steady_clock::now()) {}
+
+void ChunkTuner::record(size_t bytes, double latency) {
+    if (phase_ == SETTLED) return;
+    tuned_bytes_ += bytes;
+    window_bytes_ += bytes;
+    window_writes_ += 1;
+    window_latency_ += latency;
+
+    // Long enough to average out per-request jitter at the current setting
+    size_t window = std::max<size_t>(16 * 1024 * 1024, 4 * chunk_ * depth_);
+    if (window_bytes_ < window) return;
+
+    auto now = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(now - window_start_).count();
+    double throughput = secs > 0 ? window_bytes_ / secs : 0;
+    double avg_latency = window_latency_ / window_writes_;
+    window_bytes_ = 0;
+    window_writes_ = 0;
+    window_latency_ = 0;
+    window_start_ = now;
+
+    evaluate(throughput, avg_latency);
+    if (phase_ != SETTLED && tuned_bytes_ >= SETTLE_BUDGET) settle("budget reached");
+}
+
+void ChunkTuner::evaluate(double throughput, double latency) {
+    bool better = throughput > best_throughput_ * MIN_GAIN;
+    if (better && phase_ == GROW_DEPTH && best_latency_ > 0 && best_throughput_ > 0) {
+        // Another slot that mostly lengthens the device queue is not worth its
+        // gain: per-write latency may grow no faster than throughput does
+        better = latency / best_latency_ <= throughput / best_throughput_;
+    }
+    if (better) {
+        best_throughput_ = throughput;
+        best_latency_ = latency;
+        best_chunk_ = chunk_;
+        best_depth_ = depth_;
+    }
+
+    if (phase_ == GROW_CHUNK) {
+        if (better && chunk_ * 2 <= max_chunk_) {
+            chunk_ *= 2;   // still paying off: keep growing
+            return;
+        }
+        chunk_ = best_chunk_;   // back off a step that did not pay off
+        if (depth_ >= max_depth_) {
+            settle("chunk size converged");
+            return;
+        }
+        phase_ = GROW_DEPTH;
+        depth_ += 1;
+        return;
+    }
+
+    if (phase_ == GROW_DEPTH) {
+        if (better && depth_ < max_depth_) {
+            depth_ += 1;
+            return;
+        }
+        settle("queue depth converged");
+    }
+}
+
+void ChunkTuner::settle(const char *reason) {
+    chunk_ = best_chunk_;
+    depth_ = best_depth_;
+    phase_ = SETTLED;
+    std::cout << "Autotune [" << label_ << "]: chunk " << (chunk_ / 1024) << "KB, queue depth " << depth_
+              << " at " << (best_throughput_ / (1024 * 1024)) << "MB/s, " << (best_latency_ * 1000)
+              << "ms per write (" << reason << " after " << (tuned_bytes_ / (1024 * 1024)) << "MB)" << std::endl;
+}
@@ -0,0 +1,95 @@
+#include "bad_sectors.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <iterator>
+#include <algorithm>
+
+// Attempts per failing block after the first, and the first backoff; each
+// retry waits four times longer than the one before
+static const int BLOCK_RETRIES = 3;
+static const int BACKOFF_MS = 5;
+// A stick with more failing blocks than this is not worth finishing
+static const size_t MAX_BAD_BLOCKS = 256;
+
+// Errors that point at the medium rather than at the device or the request
+static bool media_error(int err) {
+    return err == EIO || err == ENODATA || err == EILSEQ || err == EREMOTEIO;
+}
+
+bool RetryWriter::write(const char *buf, size_t len, size_t offset) {
+    if (inner_(buf, len, offset)) return true;
+    if (!media_error(errno)) return false;
+    std::cerr << "Write error at offset " << offset << " (" << strerror(errno)
+              << "), retrying block by block" << std::endl;
+    return write_range(buf, len, offset);
+}
+
+bool RetryWriter::write_range(const char *buf, size_t len, size_t offset) {
+    if (len <= block_) {
+        for (int attempt = 0; attempt < BLOCK_RETRIES; ++attempt) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(BACKOFF_MS << (2 * attempt)));
+            ++retried_;
+            if (inner_(buf, len, offset)) return true;
+            if (!media_error(errno)) return false;
+        }
+        mark_bad(offset, len);
+        if (bad_blocks_ > MAX_BAD_BLOCKS) {
+            std::cerr << "More than " << MAX_BAD_BLOCKS << " blocks failed, giving up" << std::endl;
+            errno = EIO;
+            return false;
+        }
+        return true;
+    }
+
+    // Split on a block boundary; a half that writes cleanly is done in one go
+    size_t half = len / block_ / 2 * block_;
+    if (half == 0) half = block_;
+    for (size_t part = 0; part < 2; ++part) {
+        size_t pos = part ? half : 0;
+        size_t n = part ? len - half : half;
+        if (inner_(buf + pos, n, offset + pos)) continue;
+        if (!media_error(errno) || !write_range(buf + pos, n, offset + pos)) return false;
+    }
+    return true;
+}
+
+void RetryWriter::mark_bad(size_t offset, size_t len) {
+    bad_blocks_ += (len + block_ - 1) / block_;
+    size_t start = offset, end = offset + len;
+    auto it = bad_.upper_bound(start);
+    if (it != bad_.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second >= start) {
+            start = prev->first;
+            end = std::max(end, prev->second);
+            bad_.erase(prev);
+        }
+    }
+    while (it != bad_.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = bad_.erase(it);
+    }
+    bad_[start] = end;
+}
+
+std::vector<std::pair<size_t, size_t>> RetryWriter::bad_ranges() const {
+    std::vector<std::pair<size_t, size_t>> out;
+    for (const auto &r : bad_) out.push_back(std::make_pair(r.first, r.second - r.first));
+    return out;
+}
+
+void RetryWriter::report() const {
+    if (bad_.empty()) {
+        if (retried_ > 0) std::cout << "Write errors cleared after " << retried_ << " block retries" << std::endl;
+        return;
+    }
+    std::cerr << "Bad sectors: " << bad_blocks_ << " blocks of " << block_ << " bytes in "
+              << bad_.size() << " ranges could not be written" << std::endl;
+    for (const auto &r : bad_) {
+        std::cerr << "  blocks " << (r.first / block_) << "-" << ((r.second - 1) / block_)
+                  << " (bytes " << r.first << "-" << (r.second - 1) << ")" << std::endl;
+    }
+}
@@ -0,0 +1,59 @@
+#include "block_stats.h"
+#include <string>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+// The stat file counts in 512-byte sectors whatever the logical block size
+static const size_t SECTOR = 512;
+// Rate samples closer together than this are merged into the next one
+static const double MIN_SAMPLE_SEC = 0.2;
+
+// Sectors written, the 7th field of a block device stat file
+static bool read_write_sectors(int fd, unsigned long long &sectors) {
+    char buf[256];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return false;
+    buf[n] = '\0';
+    unsigned long long f[7];
+    if (sscanf(buf, "%llu %llu %llu %llu %llu %llu %llu", &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6]) != 7) {
+        return false;
+    }
+    sectors = f[6];
+    return true;
+}
+
+CompletionMeter::CompletionMeter(int fd) : last_time_(std::chrono::steady_clock::now()) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode)) return;
+    std::string path = "/sys/dev/block/" + std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev)) + "/stat";
+    stat_fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (stat_fd_ >= 0 && !read_write_sectors(stat_fd_, base_sectors_)) {
+        close(stat_fd_);
+        stat_fd_ = -1;
+    }
+}
+
+CompletionMeter::~CompletionMeter() {
+    if (stat_fd_ >= 0) close(stat_fd_);
+}
+
+size_t CompletionMeter::completed(size_t fallback) {
+    size_t bytes = fallback;
+    unsigned long long sectors;
+    if (stat_fd_ >= 0 && read_write_sectors(stat_fd_, sectors) && sectors >= base_sectors_) {
+        bytes = (size_t)(sectors - base_sectors_) * SECTOR;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - last_time_).count();
+    if (dt >= MIN_SAMPLE_SEC) {
+        double instant = bytes > last_bytes_ ? (bytes - last_bytes_) / dt : 0;
+        rate_ = rate_ > 0 ? 0.7 * rate_ + 0.3 * instant : instant;
+        last_bytes_ = bytes;
+        last_time_ = now;
+    }
+    return bytes;
+}
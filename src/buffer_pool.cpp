@@ -0,0 +1,86 @@
+#include "buffer_pool.h"
+#include <map>
+#include <vector>
+#include <mutex>
+#include <utility>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+// Sizes are rounded up to a power of two of at least this, so callers with
+// varying sizes share a few free lists
+static const size_t MIN_CLASS = 64 * 1024;
+// Released buffers beyond this many bytes are unmapped instead of kept
+static const size_t MAX_RETAINED = 256 * 1024 * 1024;
+
+static std::mutex pool_mutex;
+// Free buffers by (NUMA node they were allocated on, size)
+static std::map<std::pair<int, size_t>, std::vector<char *>> pool_free;
+static std::map<char *, int> pool_node;
+static size_t pool_retained = 0;
+
+static size_t size_class(size_t size) {
+    size_t c = MIN_CLASS;
+    while (c < size) c <<= 1;
+    return c;
+}
+
+// Node of the CPU we are running on; with NodePlacement that is the job's node
+static int current_node() {
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return 0;
+    return (int)node;
+}
+
+static char *map_buffer(size_t size) {
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (size % HUGE_PAGE == 0) {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+        if (size >= HUGE_PAGE) madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+    return (char *)p;
+}
+
+char *buffer_pool_acquire(size_t size) {
+    if (size == 0) return nullptr;
+    size = size_class(size);
+    int node = current_node();
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        auto it = pool_free.find(std::make_pair(node, size));
+        if (it != pool_free.end() && !it->second.empty()) {
+            char *buf = it->second.back();
+            it->second.pop_back();
+            pool_retained -= size;
+            return buf;
+        }
+    }
+    char *buf = map_buffer(size);
+    if (buf) {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        pool_node[buf] = node;
+    }
+    return buf;
+}
+
+void buffer_pool_release(char *buf, size_t size) {
+    if (!buf) return;
+    size = size_class(size);
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (pool_retained + size > MAX_RETAINED) {
+        pool_node.erase(buf);
+        munmap(buf, size);
+        return;
+    }
+    pool_free[std::make_pair(pool_node[buf], size)].push_back(buf);
+    pool_retained += size;
+}
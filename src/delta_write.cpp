@@ -0,0 +1,43 @@
+#include "delta_write.h"
+#include "buffer_pool.h"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+
+// Compare granularity; differing blocks next to each other are written as one run
+static const size_t DELTA_BLOCK = 64 * 1024;
+
+bool DeltaWriter::write(const char *buf, size_t len, size_t offset) {
+    PoolBuffer current(len);
+    if (!current) return inner_(buf, len, offset);
+
+    // A short read (target smaller than before, or read error) just means
+    // the remainder is treated as different and written
+    size_t have = 0;
+    while (have < len) {
+        ssize_t r = pread(rfd_, current.data() + have, len - have, (off_t)(offset + have));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        have += (size_t)r;
+    }
+
+    size_t pos = 0;
+    while (pos < len) {
+        size_t end = pos + std::min(DELTA_BLOCK, len - pos);
+        bool same = end <= have && memcmp(buf + pos, current.data() + pos, end - pos) == 0;
+        while (end < len) {
+            size_t n = std::min(DELTA_BLOCK, len - end);
+            bool next_same = end + n <= have && memcmp(buf + end, current.data() + end, n) == 0;
+            if (next_same != same) break;
+            end += n;
+        }
+        if (same) {
+            unchanged_ += end - pos;
+        } else if (!inner_(buf + pos, end - pos, offset + pos)) {
+            return false;
+        }
+        pos = end;
+    }
+    return true;
+}
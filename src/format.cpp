@@ -1,8 +1,9 @@
 #include "format.h"
+#include "job_control.h"
 #include <cstdlib>
 #include <iostream>
 
-bool format_usb(const std::string &device, const std::string &fs_type) {
+bool format_usb(const std::string &device, const std::string &fs_type, const CancelToken *cancel) {
     std::string cmd;
     if (fs_type == "vfat") {
         // Use parted to create msdos partition table + single primary partition, then mkfs.vfat
@@ -15,6 +16,6 @@ bool format_usb(const std::string &device, const std::string &fs_type) {
         std::cerr << "Unsupported filesystem type: " << fs_type << std::endl;
         return false;
     }
-    int rc = system(cmd.c_str());
+    int rc = run_command(cmd, cancel);
     return rc == 0;
 }
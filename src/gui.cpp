@@ -19,12 +19,14 @@
 #include <QFile>
 #include <QDateTime>
 #include <QIcon>
+#include <QSpinBox>
 
 #include "gui.h"
 #include "usb_detect.h"
 #include "format.h"
 #include "write_iso.h"
 #include "bootloader.h"
+#include "image_cache.h"
 
 #include <functional>
 
@@ -33,12 +35,12 @@ void WorkerThread::run() {
     job(progressCb);
 }
 
-MainWindow::MainWindow() : isRunning(false), progressValue(0) {
+MainWindow::MainWindow() : isRunning(false), progressValue(0), flushRemainingMb(-1), flushEtaSec(-1), workerThread(nullptr) {
     setupUI();
     setupStyles();
     populateDeviceList();
     
-    // Progress timer for simulation
+    // Moves the worker's progress onto the widgets
     progressTimer = new QTimer(this);
     connect(progressTimer, &QTimer::timeout, this, &MainWindow::onProgressUpdate);
     
@@ -79,6 +81,8 @@ void MainWindow::setupUI() {
     connect(refreshBtn, &QPushButton::clicked, this, &MainWindow::onRefreshDevices);
     connect(browseBtn, &QPushButton::clicked, this, &MainWindow::onBrowseISO);
     connect(startBtn, &QPushButton::clicked, this, &MainWindow::onStart);
+    connect(pauseBtn, &QPushButton::clicked, this, &MainWindow::onPause);
+    connect(cancelBtn, &QPushButton::clicked, this, &MainWindow::onCancel);
 }
 
 void MainWindow::setupMainTab() {
@@ -237,6 +241,18 @@ void MainWindow::setupMainTab() {
     )");
     layout->addWidget(startBtn);
     
+    // Pause / Cancel for a running job
+    auto *jobLayout = new QHBoxLayout();
+    pauseBtn = new QPushButton("Pause");
+    pauseBtn->setIcon(QIcon::fromTheme("media-playback-pause"));
+    pauseBtn->setEnabled(false);
+    cancelBtn = new QPushButton("Cancel");
+    cancelBtn->setIcon(QIcon::fromTheme("process-stop"));
+    cancelBtn->setEnabled(false);
+    jobLayout->addWidget(pauseBtn);
+    jobLayout->addWidget(cancelBtn);
+    layout->addLayout(jobLayout);
+    
     // Status Section - Clean and simple
     auto *statusGroup = new QGroupBox("Status");
     statusGroup->setStyleSheet("QGroupBox { font-weight: bold; font-size: 11pt; }");
@@ -348,6 +364,48 @@ void MainWindow::setupAdvancedTab() {
     persistentLayout->addLayout(persistentSizeLayout);
     
     layout->addWidget(persistentGroup);
+    
+    // I/O Scheduling - keeps flashing from starving other jobs on the host
+    auto *ioGroup = new QGroupBox("I/O Scheduling");
+    ioGroup->setStyleSheet("QGroupBox { font-weight: bold; font-size: 11pt; }");
+    auto *ioLayout = new QHBoxLayout(ioGroup);
+    ioLayout->setSpacing(10);
+    
+    ioClassCombo = new QComboBox();
+    ioClassCombo->addItems({"Default", "Realtime", "Best effort", "Idle"});
+    ioClassCombo->setToolTip("I/O priority class for the write job");
+    ioClassCombo->setMinimumHeight(32);
+    ioClassCombo->setStyleSheet("QComboBox { font-size: 10pt; }");
+    
+    ioLevelSpin = new QSpinBox();
+    ioLevelSpin->setRange(0, 7);
+    ioLevelSpin->setValue(4);
+    ioLevelSpin->setPrefix("Level ");
+    ioLevelSpin->setToolTip("Priority level within the class (0 is highest)");
+    ioLevelSpin->setMinimumHeight(32);
+    
+    bandwidthCapSpin = new QSpinBox();
+    bandwidthCapSpin->setRange(0, 10000);
+    bandwidthCapSpin->setSuffix(" MB/s");
+    bandwidthCapSpin->setSpecialValueText("No limit");
+    bandwidthCapSpin->setToolTip("Maximum write throughput");
+    bandwidthCapSpin->setMinimumHeight(32);
+    
+    // Stations flashing the same ISO repeatedly keep it in RAM
+    imageCacheSpin = new QSpinBox();
+    imageCacheSpin->setRange(0, 65536);
+    imageCacheSpin->setSingleStep(512);
+    imageCacheSpin->setSuffix(" MB");
+    imageCacheSpin->setSpecialValueText("No image cache");
+    imageCacheSpin->setToolTip("Memory for keeping recently written images in RAM");
+    imageCacheSpin->setMinimumHeight(32);
+    
+    ioLayout->addWidget(ioClassCombo);
+    ioLayout->addWidget(ioLevelSpin);
+    ioLayout->addWidget(bandwidthCapSpin);
+    ioLayout->addWidget(imageCacheSpin);
+    ioLayout->addStretch();
+    layout->addWidget(ioGroup);
     layout->addStretch();
 }
 
@@ -655,8 +713,12 @@ void MainWindow::onStart() {
     
     // Start operation
     startBtn->setEnabled(false);
+    pauseBtn->setEnabled(true);
+    pauseBtn->setText("Pause");
+    cancelBtn->setEnabled(true);
     isRunning = true;
     progressValue = 0;
+    flushRemainingMb = -1;
     progressBar->setValue(0);
     
     updateStatus("Starting operation...");
@@ -664,6 +726,8 @@ void MainWindow::onStart() {
     // Create worker thread
     workerThread = new WorkerThread();
     workerThread->job = [this, devicePath, isoPath = selectedIsoPath.toStdString(), 
+                        cancel = &workerThread->cancel, pause = &workerThread->pause,
+                        succeeded = &workerThread->succeeded,
                         fs = filesystemCombo->currentText().toStdString(),
                         bootloader = bootloaderCombo->currentText().toStdString(),
                         partitionScheme = partitionSchemeCombo->currentText().toStdString(),
@@ -672,12 +736,20 @@ void MainWindow::onStart() {
                         quickFormat = quickFormatRadio->isChecked(),
                         checkBadBlocks = checkBadBlocksCheck->isChecked(),
                         persistent = persistentCheck->isChecked(),
-                        persistentSize = persistentSizeCombo->currentText().toStdString()](std::function<void(size_t,size_t)> progressFunc) {
+                        persistentSize = persistentSizeCombo->currentText().toStdString(),
+                        ioClass = ioClassCombo->currentIndex(),
+                        ioLevel = ioLevelSpin->value(),
+                        maxMbps = bandwidthCapSpin->value(),
+                        imageCacheMb = imageCacheSpin->value()](std::function<void(size_t,size_t)> progressFunc) {
         
         updateStatus("Formatting device...");
         
         // Format device with new options
-        bool formatted = format_usb(devicePath.toStdString(), fs);
+        bool formatted = format_usb(devicePath.toStdString(), fs, cancel);
+        if (cancel->cancelled() || !pause->wait(cancel)) {
+            updateStatus("Operation cancelled");
+            return;
+        }
         if (!formatted) {
             updateStatus("Format failed, attempting raw write");
         } else {
@@ -685,59 +757,103 @@ void MainWindow::onStart() {
         }
         
         // Write ISO
-        bool writeOk = write_iso_to_usb(isoPath, devicePath.toStdString(), progressFunc);
+        image_cache_set_budget((size_t)imageCacheMb * 1024 * 1024);
+        WriteOptions writeOptions;
+        writeOptions.io_class = ioClass;
+        writeOptions.io_level = ioLevel;
+        writeOptions.max_mbps = maxMbps;
+        WriteReport writeReport;
+        writeOptions.report = &writeReport;
+        writeOptions.cancel = cancel;
+        writeOptions.pause = pause;
+        writeOptions.status_callback = [this](const WriteProgress &status) {
+            flushRemainingMb = status.flushing ? int(status.pending / (1024 * 1024)) : -1;
+            flushEtaSec = status.eta_sec >= 0 ? int(status.eta_sec + 0.5) : -1;
+        };
+        bool writeOk = write_iso_to_usb_advanced(isoPath, devicePath.toStdString(), progressFunc, writeOptions);
+        flushRemainingMb = -1;
         if (!writeOk) {
-            updateStatus("Write operation failed");
+            if (writeReport.cancelled) {
+                updateStatus("Operation cancelled");
+            } else if (writeReport.device_removed) {
+                updateStatus(QString("Device removed at offset %1 MB").arg(writeReport.removed_at / (1024 * 1024)));
+            } else {
+                updateStatus("Write operation failed");
+            }
             return;
         }
         
         updateStatus("Write completed, installing bootloader...");
         
         // Install bootloader
-        if (bootloader == "Syslinux") {
-            install_syslinux(devicePath.toStdString());
-        } else if (bootloader == "GRUB") {
-            // Mount and install GRUB
-            std::string mountPoint = "/tmp/bootusb_mount";
-            std::string cmd = "sudo mkdir -p " + mountPoint + " && sudo mount " + devicePath.toStdString() + "1 " + mountPoint;
-            system(cmd.c_str());
-            
-            cmd = "sudo grub-install --target=i386-pc --boot-directory=" + mountPoint + "/boot " + devicePath.toStdString();
-            system(cmd.c_str());
-            
-            system(("sudo umount " + mountPoint).c_str());
-        }
-        
-        updateStatus("Operation completed successfully");
+        if (!pause->wait(cancel)) {
+            updateStatus("Operation cancelled");
+            return;
+        }
+        if (bootloader == "Syslinux" || bootloader == "GRUB") {
+            install_bootloader_advanced(devicePath.toStdString(), bootloader, cancel);
+        }
+        if (cancel->cancelled()) {
+            updateStatus("Operation cancelled");
+            return;
+        }
+        
+        *succeeded = true;
     };
     
+    // Reports what the device has completed, so 100% means the data is on the stick
     workerThread->progressCb = [this](size_t written, size_t total) {
-        int percentage = total > 0 ? int((100.0 * written) / total) : 0;
-        progressValue = percentage;
-        progressBar->setValue(percentage);
-        
-        if (percentage == 100) {
-            onOperationComplete();
-        }
+        progressValue = total > 0 ? int((100.0 * written) / total) : 0;
     };
     
     connect(workerThread, &QThread::finished, [this]() {
+        if (workerThread->succeeded) {
+            onOperationComplete();
+        } else {
+            isRunning = false;
+            startBtn->setEnabled(true);
+            progressTimer->stop();
+            progressBar->setValue(progressValue);
+        }
+        pauseBtn->setEnabled(false);
+        cancelBtn->setEnabled(false);
         workerThread->deleteLater();
     });
     
     workerThread->start();
     
-    // Start progress simulation timer
     progressTimer->start(100);
 }
 
+void MainWindow::onPause() {
+    if (!isRunning || !workerThread) return;
+    if (workerThread->pause.paused()) {
+        workerThread->pause.resume();
+        pauseBtn->setText("Pause");
+        updateStatus("Resumed");
+    } else {
+        workerThread->pause.pause();
+        pauseBtn->setText("Resume");
+        updateStatus("Paused");
+    }
+}
+
+void MainWindow::onCancel() {
+    if (!isRunning || !workerThread) return;
+    workerThread->cancel.cancel();
+    cancelBtn->setEnabled(false);
+    pauseBtn->setEnabled(false);
+    updateStatus("Cancelling...");
+}
+
 void MainWindow::onProgressUpdate() {
-    if (isRunning && progressValue < 100) {
-        // Simulate progress for better UX
-        int currentProgress = progressBar->value();
-        if (currentProgress < progressValue) {
-            progressBar->setValue(currentProgress + 1);
-        }
+    if (!isRunning) return;
+    progressBar->setValue(progressValue);
+    int flushMb = flushRemainingMb;
+    if (flushMb >= 0) {
+        int eta = flushEtaSec;
+        statusLabel->setText(eta >= 0 ? QString("Flushing %1 MB to the device, about %2 s left").arg(flushMb).arg(eta)
+                                      : QString("Flushing %1 MB to the device").arg(flushMb));
     }
 }
 
@@ -0,0 +1,131 @@
+#include "hash_manifest.h"
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+HashManifest::HashManifest(const ImageDigest &digest) : total_(digest.total()) {
+    build(digest.blocks());
+}
+
+void HashManifest::build(std::vector<Digest> leaves) {
+    levels_.clear();
+    levels_.push_back(std::move(leaves));
+    while (levels_.back().size() > 1) {
+        const std::vector<Digest> &below = levels_.back();
+        std::vector<Digest> level((below.size() + 1) / 2);
+        for (size_t i = 0; i < level.size(); ++i) {
+            if (2 * i + 1 == below.size()) {
+                level[i] = below[2 * i];
+                continue;
+            }
+            // The prefix keeps interior nodes distinct from block digests
+            static const uint8_t interior = 0x01;
+            Sha256 h;
+            h.update(&interior, 1);
+            h.update(below[2 * i].data(), below[2 * i].size());
+            h.update(below[2 * i + 1].data(), below[2 * i + 1].size());
+            h.finish(level[i].data());
+        }
+        levels_.push_back(std::move(level));
+    }
+}
+
+std::string HashManifest::root_hex() const {
+    if (levels_.empty() || levels_.back().empty()) return "";
+    return Sha256::hex(levels_.back()[0].data());
+}
+
+std::vector<size_t> HashManifest::differing_blocks(const HashManifest &other, size_t *nodes) const {
+    std::vector<size_t> out;
+    size_t compared = 0;
+    if (other.total_ != total_ || other.levels_.size() != levels_.size()) {
+        // Trees of different images: nothing lines up
+        for (size_t i = 0; i < blocks(); ++i) out.push_back(i);
+    } else if (!levels_.empty()) {
+        // Depth-first from the root, so blocks come out in offset order
+        std::vector<std::pair<size_t, size_t>> stack;  // (level, index)
+        stack.emplace_back(levels_.size() - 1, 0);
+        while (!stack.empty()) {
+            size_t level = stack.back().first, index = stack.back().second;
+            stack.pop_back();
+            ++compared;
+            if (levels_[level][index] == other.levels_[level][index]) continue;
+            if (level == 0) {
+                out.push_back(index);
+                continue;
+            }
+            const std::vector<Digest> &below = levels_[level - 1];
+            if (2 * index + 1 < below.size()) stack.emplace_back(level - 1, 2 * index + 1);
+            stack.emplace_back(level - 1, 2 * index);
+        }
+    }
+    if (nodes) *nodes = compared;
+    return out;
+}
+
+bool HashManifest::save(const std::string &path) const {
+    if (levels_.empty()) return false;
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        std::cerr << "Cannot write hash manifest " << tmp << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    fprintf(f, "bootusb-manifest-1\n");
+    fprintf(f, "image %zu %zu\n", total_, BLOCK);
+    fprintf(f, "root %s\n", root_hex().c_str());
+    for (const Digest &d : levels_[0]) fprintf(f, "block %s\n", Sha256::hex(d.data()).c_str());
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        std::cerr << "Cannot write hash manifest: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool parse_hex(const std::string &hex, HashManifest::Digest &out) {
+    if (hex.size() != 2 * out.size()) return false;
+    for (size_t i = 0; i < out.size(); ++i) {
+        unsigned v;
+        if (sscanf(hex.c_str() + 2 * i, "%2x", &v) != 1) return false;
+        out[i] = (uint8_t)v;
+    }
+    return true;
+}
+
+bool HashManifest::load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) return false;
+
+    std::string magic, field, root, hex;
+    size_t total = 0, block = 0;
+    std::vector<Digest> leaves;
+    in >> magic;
+    if (magic != "bootusb-manifest-1") return false;
+    while (in >> field) {
+        if (field == "image") {
+            in >> total >> block;
+        } else if (field == "root") {
+            in >> root;
+        } else if (field == "block") {
+            Digest d;
+            in >> hex;
+            if (!parse_hex(hex, d)) return false;
+            leaves.push_back(d);
+        }
+    }
+    if (block != BLOCK || total == 0 || leaves.size() != (total + BLOCK - 1) / BLOCK) return false;
+    total_ = total;
+    build(std::move(leaves));
+    if (root_hex() != root) {
+        std::cerr << "Hash manifest " << path << " is damaged: its root does not match its blocks" << std::endl;
+        levels_.clear();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,284 @@
+#include "image_cache.h"
+#include "io_util.h"
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+static const size_t LOAD_CHUNK = 8 * 1024 * 1024;
+
+namespace {
+
+struct CachedImage {
+    std::string path;
+    dev_t dev;
+    ino_t ino;
+    size_t size;         // image bytes
+    long long mtime_ns;
+    int fd = -1;         // the memfd
+    char *map = nullptr;
+    size_t map_size = 0; // size rounded up to the memfd's page size
+    bool hugetlb = false;
+    bool locked = false;
+    bool loading = false; // a job is filling it; others for the same image wait on cache_loaded
+};
+
+}
+
+static std::mutex cache_mutex;
+static std::condition_variable cache_loaded;
+// Most recently used first
+static std::list<CachedImage> cache;
+static size_t cache_budget = 0;
+static ImageCacheStats stats;
+
+// A new open file description, so each job has its own file offset (a dup
+// would share one)
+static int reopen(const CachedImage &img) {
+    std::string path = "/proc/self/fd/" + std::to_string(img.fd);
+    return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+static void release(CachedImage &img) {
+    if (img.map) munmap(img.map, img.map_size);
+    if (img.fd >= 0) close(img.fd);
+}
+
+// Bytes an image of size may take: a hugetlb copy is rounded up to whole
+// hugepages, and the budget has to hold whichever backing it gets
+static size_t charged_size(size_t size) {
+#ifdef MFD_HUGETLB
+    return (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+#else
+    return size;
+#endif
+}
+
+static void drop(std::list<CachedImage>::iterator it) {
+    stats.bytes -= it->map_size;
+    if (it->locked) stats.locked_bytes -= it->map_size;
+    release(*it);
+    cache.erase(it);
+}
+
+// Evicts the least recently used image that is not being loaded; false if
+// there is none
+static bool evict_lru() {
+    for (auto it = cache.end(); it != cache.begin(); ) {
+        --it;
+        if (it->loading) continue;
+        std::cout << "Image cache: evicting " << it->path << std::endl;
+        stats.evictions++;
+        drop(it);
+        return true;
+    }
+    return false;
+}
+
+// Backing memory for size bytes: hugetlb memfd first, which needs the size
+// rounded to whole hugepages, then a regular shmem memfd
+static bool create_backing(CachedImage &img) {
+#ifdef MFD_HUGETLB
+    img.map_size = (img.size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    img.fd = memfd_create("bootusb-image", MFD_CLOEXEC | MFD_HUGETLB);
+    if (img.fd >= 0 && ftruncate(img.fd, (off_t)img.map_size) == 0) {
+        void *p = mmap(nullptr, img.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, img.fd, 0);
+        if (p != MAP_FAILED) {
+            img.map = (char *)p;
+            img.hugetlb = true;
+            return true;
+        }
+    }
+    if (img.fd >= 0) close(img.fd);
+#endif
+    img.map_size = img.size;
+    img.fd = memfd_create("bootusb-image", MFD_CLOEXEC);
+    if (img.fd < 0 || ftruncate(img.fd, (off_t)img.map_size) != 0) return false;
+    void *p = mmap(nullptr, img.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, img.fd, 0);
+    if (p == MAP_FAILED) return false;
+    img.map = (char *)p;
+#ifdef MADV_HUGEPAGE
+    // Effective when shmem transparent hugepages are enabled
+    madvise(img.map, img.map_size, MADV_HUGEPAGE);
+#endif
+    return true;
+}
+
+// Polled between chunks of a load and while waiting for another job's load
+static const std::chrono::milliseconds STOP_POLL(50);
+
+static bool load(CachedImage &img, int src, const std::function<bool()> &should_stop) {
+    if (!create_backing(img)) {
+        std::cerr << "Image cache: cannot allocate " << (img.size / (1024*1024)) << "MB: " << strerror(errno) << std::endl;
+        return false;
+    }
+    size_t done = 0;
+    while (done < img.size) {
+        if (should_stop && should_stop()) {
+            std::cout << "Image cache: loading " << img.path << " stopped" << std::endl;
+            return false;
+        }
+        ssize_t r = read_full(src, img.map + done, std::min(LOAD_CHUNK, img.size - done));
+        if (r <= 0) {
+            std::cerr << "Image cache: error reading " << img.path << std::endl;
+            return false;
+        }
+        done += (size_t)r;
+    }
+    // The cache holds the only copy worth keeping
+    posix_fadvise(src, 0, 0, POSIX_FADV_DONTNEED);
+
+    img.locked = mlock(img.map, img.map_size) == 0;
+    if (!img.locked) {
+        std::cerr << "Image cache: could not lock " << img.path << " into RAM (" << strerror(errno)
+                  << "), it may be swapped out" << std::endl;
+    }
+    std::cout << "Image cache: loaded " << img.path << " (" << (img.size / (1024*1024)) << "MB"
+              << (img.hugetlb ? ", hugetlb" : "") << (img.locked ? ", locked" : "") << ")"
+              << std::endl;
+    return true;
+}
+
+void image_cache_set_budget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache_budget = bytes;
+    stats.budget = bytes;
+    while (stats.bytes > cache_budget && evict_lru()) {}
+    stats.images = cache.size();
+}
+
+int image_cache_open(const std::string &path, std::function<bool()> should_stop) {
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cache_budget == 0) return -1;
+    }
+
+    int src = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) return -1;
+    struct stat st;
+    if (fstat(src, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(src);
+        return -1;
+    }
+    long long mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    auto same_file = [&](const CachedImage &img) {
+        return img.dev == st.st_dev && img.ino == st.st_ino && img.size == (size_t)st.st_size && img.mtime_ns == mtime_ns;
+    };
+
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    for (;;) {
+        auto it = cache.begin();
+        while (it != cache.end() && it->path != path) ++it;
+        if (it == cache.end()) break;
+        if (it->loading) {
+            if (!same_file(*it)) {
+                // Another version is being loaded; leave the cache to it
+                close(src);
+                return -1;
+            }
+            // A second job for the same image waits for the copy instead of
+            // reading the disk alongside it; other images are not held up
+            cache_loaded.wait_for(lock, STOP_POLL);
+            if (should_stop && should_stop()) {
+                close(src);
+                return -1;
+            }
+            continue;
+        }
+        if (same_file(*it)) {
+            close(src);
+            cache.splice(cache.begin(), cache, it);
+            stats.hits++;
+            std::cout << "Image cache: hit for " << path << std::endl;
+            return reopen(cache.front());
+        }
+        // Changed on disk since it was loaded
+        drop(it);
+        break;
+    }
+
+    stats.misses++;
+    size_t size = (size_t)st.st_size;
+    size_t charge = charged_size(size);
+    if (size == 0 || charge > cache_budget) {
+        if (size > 0) {
+            std::cout << "Image cache: " << path << " is larger than the " << (cache_budget / (1024*1024))
+                      << "MB budget, reading it from disk" << std::endl;
+        }
+        close(src);
+        stats.images = cache.size();
+        return -1;
+    }
+    while (stats.bytes + charge > cache_budget && evict_lru()) {}
+    if (stats.bytes + charge > cache_budget) {
+        std::cout << "Image cache: other images are loading, reading " << path << " from disk" << std::endl;
+        close(src);
+        return -1;
+    }
+
+    // Reserve the space with a placeholder, then load without the lock
+    CachedImage placeholder;
+    placeholder.path = path;
+    placeholder.dev = st.st_dev;
+    placeholder.ino = st.st_ino;
+    placeholder.size = size;
+    placeholder.mtime_ns = mtime_ns;
+    placeholder.map_size = charge;
+    placeholder.loading = true;
+    cache.push_front(placeholder);
+    auto entry = cache.begin();
+    stats.bytes += charge;
+    stats.images = cache.size();
+    lock.unlock();
+
+    CachedImage img = placeholder;
+    img.loading = false;
+    bool ok = load(img, src, should_stop);
+    close(src);
+    // Jobs read through fds, the mapping is only needed to keep the pages locked
+    if (ok && !img.locked) {
+        munmap(img.map, img.map_size);
+        img.map = nullptr;
+    }
+
+    lock.lock();
+    // Loading entries are never evicted, so entry is still ours
+    stats.bytes -= charge;
+    if (!ok) {
+        release(img);
+        cache.erase(entry);
+        stats.images = cache.size();
+        cache_loaded.notify_all();
+        return -1;
+    }
+    *entry = img;
+    stats.bytes += img.map_size;
+    if (img.locked) stats.locked_bytes += img.map_size;
+    int fd = reopen(*entry);
+    // The budget may have shrunk while loading
+    while (stats.bytes > cache_budget && evict_lru()) {}
+    stats.images = cache.size();
+    cache_loaded.notify_all();
+    return fd;
+}
+
+void image_cache_log_stats() {
+    ImageCacheStats s = image_cache_stats();
+    if (s.budget == 0) return;
+    std::cout << "Image cache: " << s.hits << " hits, " << s.misses << " misses, " << s.evictions << " evictions; "
+              << s.images << " images in " << (s.bytes / (1024*1024)) << "MB (" << (s.locked_bytes / (1024*1024))
+              << "MB locked) of a " << (s.budget / (1024*1024)) << "MB budget" << std::endl;
+}
+
+ImageCacheStats image_cache_stats() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return stats;
+}
@@ -0,0 +1,38 @@
+#include "image_digest.h"
+#include <algorithm>
+
+void ImageDigest::update(const char *buf, size_t len, size_t offset) {
+    if (broken_) return;
+    if (offset != seen_ || seen_ + len > total_) {
+        broken_ = true;
+        return;
+    }
+    while (len > 0) {
+        size_t in_block = seen_ % BLOCK;
+        size_t n = std::min(len, BLOCK - in_block);
+        current_.update(buf, n);
+        buf += n;
+        len -= n;
+        seen_ += n;
+        if (seen_ % BLOCK == 0 || seen_ == total_) {
+            size_t index = ready_.load(std::memory_order_relaxed);
+            current_.finish(blocks_[index].data());
+            current_.reset();
+            ready_.store(index + 1, std::memory_order_release);
+        }
+    }
+}
+
+bool ImageDigest::block(size_t index, Digest &out) const {
+    if (index >= ready_.load(std::memory_order_acquire)) return false;
+    out = blocks_[index];
+    return true;
+}
+
+std::string ImageDigest::image_hex() const {
+    Sha256 h;
+    for (const Digest &d : blocks_) h.update(d.data(), d.size());
+    uint8_t out[32];
+    h.finish(out);
+    return Sha256::hex(out);
+}
@@ -0,0 +1,51 @@
+#include "io_sched.h"
+#include <thread>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+#include <linux/ioprio.h>
+#endif
+
+unsigned short io_priority_value(int io_class, int level) {
+    if (io_class <= IO_CLASS_DEFAULT || io_class > IO_CLASS_IDLE) return 0;
+    if (level < 0) level = 0;
+    if (level > 7) level = 7;
+    return (unsigned short)((io_class << 13) | (io_class == IO_CLASS_IDLE ? 0 : level));
+}
+
+int set_thread_io_priority(unsigned short ioprio) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    // who == 0 with IOPRIO_WHO_PROCESS means the calling thread
+    int previous = (int)syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (int)ioprio) != 0) return -1;
+    return previous;
+#else
+    (void)ioprio;
+    return -1;
+#endif
+}
+
+TokenBucket::TokenBucket(double bytes_per_sec, size_t burst)
+    : rate_(bytes_per_sec), burst_((double)burst), tokens_((double)burst),
+      last_(std::chrono::steady_clock::now()) {}
+
+void TokenBucket::consume(size_t bytes) {
+    if (rate_ <= 0) return;
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+    tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+    tokens_ -= (double)bytes;
+    if (tokens_ < 0) {
+        // Sleep off the debt; the tokens earned meanwhile exactly repay it.
+        // Any oversleep is credited on the next call since last_ is the
+        // scheduled wake-up, not the actual one.
+        auto wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(-tokens_ / rate_));
+        std::this_thread::sleep_for(wait);
+        last_ = now + wait;
+        tokens_ = 0;
+    }
+}
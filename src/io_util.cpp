@@ -0,0 +1,85 @@
+#include "io_util.h"
+#include <cerrno>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <vector>
+#include <algorithm>
+
+ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, buf + got, len - got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+bool write_full(int fd, const char *buf, size_t len) {
+    size_t put = 0;
+    while (put < len) {
+        ssize_t w = write(fd, buf + put, len - put);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (w == 0) {
+            errno = ENOSPC;
+            return false;
+        }
+        put += (size_t)w;
+    }
+    return true;
+}
+
+bool pwrite_full(int fd, const char *buf, size_t len, size_t offset) {
+    size_t put = 0;
+    while (put < len) {
+        ssize_t w = pwrite(fd, buf + put, len - put, (off_t)(offset + put));
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (w == 0) {
+            errno = ENOSPC;
+            return false;
+        }
+        put += (size_t)w;
+    }
+    return true;
+}
+
+size_t logical_block_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 512;
+    if (S_ISBLK(st.st_mode)) {
+        int lbs = 0;
+        if (ioctl(fd, BLKSSZGET, &lbs) == 0 && lbs > 0) return (size_t)lbs;
+        return 512;
+    }
+    return st.st_blksize > 0 ? (size_t)st.st_blksize : 4096;
+}
+
+ssize_t resident_bytes(int fd, size_t offset, size_t len) {
+    if (len == 0) return 0;
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page - 1);
+    size_t span = offset + len - start;
+    // Mapping does not fault anything in; mincore only reads the page cache
+    void *map = mmap(nullptr, span, PROT_READ, MAP_SHARED, fd, (off_t)start);
+    if (map == MAP_FAILED) return -1;
+    std::vector<unsigned char> vec((span + page - 1) / page);
+    int rc = mincore(map, span, vec.data());
+    munmap(map, span);
+    if (rc != 0) return -1;
+    size_t pages = 0;
+    for (unsigned char v : vec) pages += v & 1;
+    return (ssize_t)std::min(pages * page, span);
+}
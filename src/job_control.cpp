@@ -0,0 +1,79 @@
+#include "job_control.h"
+#include <iostream>
+#include <thread>
+#include <csignal>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// How often blocked waits look at the cancel flag; keeps cancel well
+// inside its 200ms budget
+static const std::chrono::milliseconds POLL_INTERVAL(20);
+
+static long long now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CancelToken::cancel() {
+    if (!cancelled_.exchange(true)) cancelled_at_.store(now_ms());
+}
+
+long long CancelToken::since_cancel_ms() const {
+    return cancelled() ? now_ms() - cancelled_at_.load() : 0;
+}
+
+void PauseToken::pause() {
+    paused_.store(true);
+}
+
+void PauseToken::resume() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paused_.store(false);
+    }
+    cv_.notify_all();
+}
+
+bool PauseToken::wait(const CancelToken *cancel) {
+    if (paused()) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Cancel does not know about us, so re-check it on a short timeout
+        while (paused_.load() && !(cancel && cancel->cancelled())) {
+            cv_.wait_for(lock, POLL_INTERVAL);
+        }
+    }
+    return !(cancel && cancel->cancelled());
+}
+
+int run_command(const std::string &cmd, const CancelToken *cancel) {
+    if (cancel && cancel->cancelled()) return -1;
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        // Own process group, so cancel reaches sudo and everything it starts
+        setpgid(0, 0);
+        execl("/bin/sh", "sh", "-c", cmd.c_str(), (char *)nullptr);
+        _exit(127);
+    }
+    setpgid(pid, pid);
+
+    int status = 0;
+    int polls_since_term = -1;
+    for (;;) {
+        pid_t r = waitpid(pid, &status, cancel ? WNOHANG : 0);
+        if (r == pid) break;
+        if (r < 0 && errno != EINTR) return -1;
+        if (r != 0) continue;
+        if (polls_since_term < 0 && cancel->cancelled()) {
+            std::cerr << "Cancelling: " << cmd << std::endl;
+            kill(-pid, SIGTERM);
+            polls_since_term = 0;
+        } else if (polls_since_term >= 0 && ++polls_since_term == 5) {
+            // Still there after 100ms: it does not get a say any more
+            kill(-pid, SIGKILL);
+        }
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+    return polls_since_term >= 0 ? -1 : status;
+}
@@ -0,0 +1,204 @@
+#include "mapped_source.h"
+#include "autotune.h"
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/resource.h>
+#include <csignal>
+#include <csetjmp>
+
+// How far readahead runs ahead of the writer
+static const size_t PREFETCH_AHEAD = 64 * 1024 * 1024;
+static const size_t PREFETCH_STEP = 8 * 1024 * 1024;
+
+using MapKey = std::tuple<dev_t, ino_t, off_t, long long>;
+static std::mutex map_mutex;
+static std::map<MapKey, std::weak_ptr<MappedImage>> open_maps;
+
+// A fault on the mapping (the file shrank under the job, or its storage
+// returned an I/O error) raises SIGBUS. fault_in() catches it on its own
+// thread; anywhere else the signal keeps its previous disposition.
+static thread_local sigjmp_buf *volatile fault_jump = nullptr;
+static struct sigaction previous_sigbus;
+
+static void on_sigbus(int sig, siginfo_t *info, void *context) {
+    if (fault_jump) siglongjmp(*fault_jump, 1);
+    if (previous_sigbus.sa_flags & SA_SIGINFO) {
+        if (previous_sigbus.sa_sigaction) {
+            previous_sigbus.sa_sigaction(sig, info, context);
+            return;
+        }
+    } else if (previous_sigbus.sa_handler != SIG_DFL && previous_sigbus.sa_handler != SIG_IGN) {
+        previous_sigbus.sa_handler(sig);
+        return;
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_sigbus_handler() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = on_sigbus;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, &previous_sigbus);
+    });
+}
+
+std::shared_ptr<MappedImage> MappedImage::open(int fd, size_t size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size == 0 || (size_t)st.st_size < size) return nullptr;
+
+    // A modified file is a different image: mtime is part of the key
+    MapKey key(st.st_dev, st.st_ino, (off_t)size, (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+    std::lock_guard<std::mutex> lock(map_mutex);
+    // Entries of mappings that are gone
+    for (auto e = open_maps.begin(); e != open_maps.end(); ) {
+        if (e->second.expired()) e = open_maps.erase(e);
+        else ++e;
+    }
+    auto it = open_maps.find(key);
+    if (it != open_maps.end()) {
+        if (auto shared = it->second.lock()) {
+            std::cout << "mmap source: sharing an existing mapping of the image" << std::endl;
+            return shared;
+        }
+    }
+
+    // A cached image is a memfd: hugetlb ones map, unmap and advise in whole
+    // hugepages, and neither kind has pages a drop-behind could free
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    bool in_memory = false;
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == 0) {
+        if (fs.f_type == HUGETLBFS_MAGIC) page = (size_t)fs.f_bsize;
+        in_memory = fs.f_type == HUGETLBFS_MAGIC || fs.f_type == TMPFS_MAGIC;
+    }
+    size_t map_size = (size + page - 1) / page * page;
+    if ((size_t)st.st_size < map_size) map_size = size;
+
+    void *p = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        std::cerr << "mmap of the image failed: " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+    madvise(p, map_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    // Only honored where the kernel supports huge pages for read-only file
+    // mappings; elsewhere it fails harmlessly
+    if (!in_memory) madvise(p, map_size, MADV_HUGEPAGE);
+#endif
+    install_sigbus_handler();
+    std::shared_ptr<MappedImage> image(new MappedImage((const char *)p, size, map_size, page, in_memory));
+    open_maps[key] = image;
+    return image;
+}
+
+MappedImage::~MappedImage() {
+    munmap((void *)data_, map_size_);
+    // Expired entries are left for the next open() of the same key to replace
+}
+
+// madvise wants whole pages of the mapping
+void MappedImage::advise(size_t offset, size_t len, int advice) const {
+    if (offset >= size_) return;
+    size_t begin = offset / page_ * page_;
+    size_t end = std::min((std::min(offset + len, size_) + page_ - 1) / page_ * page_, map_size_);
+    madvise((void *)(data_ + begin), end - begin, advice);
+}
+
+void MappedImage::will_need(size_t offset, size_t len) const {
+    if (in_memory_) return;
+    advise(offset, len, MADV_WILLNEED);
+}
+
+void MappedImage::read_ahead(size_t cursor, size_t &prefetched) const {
+    // Issued in PREFETCH_STEP batches rather than once per chunk
+    size_t horizon = std::min(cursor + PREFETCH_AHEAD, size_);
+    if (horizon < prefetched + PREFETCH_STEP && horizon < size_) return;
+    if (horizon > prefetched) will_need(prefetched, horizon - prefetched);
+    prefetched = std::max(prefetched, horizon);
+}
+
+bool MappedImage::fault_in(size_t offset, size_t len) const {
+    if (offset >= size_) return true;
+    size_t end = std::min(offset + len, size_);
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 1) != 0) {
+        fault_jump = nullptr;
+        return false;
+    }
+    fault_jump = &jump;
+    for (size_t p = offset / page_ * page_; p < end; p += page_) (void)*(volatile const char *)(data_ + p);
+    fault_jump = nullptr;
+    return true;
+}
+
+void MappedImage::done_with(size_t offset, size_t len) const {
+    if (in_memory_) return;
+    advise(offset, len, MADV_DONTNEED);
+}
+
+FaultCounter::FaultCounter() {
+    struct rusage ru;
+    if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+        major_ = ru.ru_majflt;
+        minor_ = ru.ru_minflt;
+    }
+}
+
+void FaultCounter::faults(long &major, long &minor) const {
+    struct rusage ru;
+    major = minor = 0;
+    if (getrusage(RUSAGE_THREAD, &ru) != 0) return;
+    major = ru.ru_majflt - major_;
+    minor = ru.ru_minflt - minor_;
+}
+
+bool mapped_copy(const MappedImage &image, const ChunkSink &sink, size_t start, size_t length, size_t chunk_size,
+                 std::function<void(size_t, size_t)> progress_callback, ChunkTuner *tuner, bool drop_behind) {
+    const size_t CHUNK = chunk_size > 0 ? chunk_size : 4 * 1024 * 1024;
+    if (start + length > image.size()) {
+        std::cerr << "mmap source: range past the end of the image" << std::endl;
+        return false;
+    }
+
+    size_t written = 0;
+    size_t prefetched = start;
+    while (written < length) {
+        size_t off = start + written;
+        size_t len = std::min(tuner ? tuner->chunk() : CHUNK, length - written);
+        image.read_ahead(off + len, prefetched);
+        if (!image.fault_in(off, len)) {
+            std::cerr << "Error reading ISO at offset " << off << ": the file changed or could not be read" << std::endl;
+            return false;
+        }
+
+        auto write_start = std::chrono::steady_clock::now();
+        if (!sink(image.data() + off, len, written)) {
+            std::cerr << "Error writing to USB: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (tuner) {
+            tuner->record(len, std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - write_start).count());
+        }
+        if (drop_behind) image.done_with(off, len);
+        written += len;
+        if (progress_callback) progress_callback(written, length);
+    }
+    return true;
+}
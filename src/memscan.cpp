@@ -0,0 +1,209 @@
+#include "memscan.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define BOOTUSB_X86_DISPATCH 1
+#endif
+
+bool is_zero(const char *p, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF) return false;
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        if (w) return false;
+    }
+    for (; i < len; ++i) {
+        if (p[i]) return false;
+    }
+    return true;
+}
+
+namespace {
+
+// Range bookkeeping shared by every kernel: differing bytes arrive as one
+// bit per byte for each 64-byte block, or one byte at a time for the tail
+struct RangeBuilder {
+    ByteRanges &out;
+    size_t merge_gap;
+    bool open = false;
+    size_t start = 0;
+    bool differs = false;
+
+    void close(size_t end) {
+        open = false;
+        if (!out.empty() && start - (out.back().first + out.back().second) <= merge_gap) {
+            out.back().second = end - out.back().first;
+        } else {
+            out.emplace_back(start, end - start);
+        }
+    }
+
+    // mask: bit i set if byte base + i differs
+    void block(uint64_t mask, size_t base) {
+        unsigned pos = 0;
+        while (pos < 64) {
+            uint64_t rest = mask >> pos;
+            if (!open) {
+                if (rest == 0) return;
+                pos += (unsigned)__builtin_ctzll(rest);
+                start = base + pos;
+                open = differs = true;
+            } else {
+                uint64_t same = ~rest;
+                if (pos > 0) same &= (1ULL << (64 - pos)) - 1;
+                if (same == 0) return;  // the range runs into the next block
+                pos += (unsigned)__builtin_ctzll(same);
+                close(base + pos);
+            }
+        }
+    }
+
+    void byte(bool differs, size_t at) {
+        if (differs && !open) {
+            start = at;
+            open = this->differs = true;
+        } else if (!differs && open) {
+            close(at);
+        }
+    }
+};
+
+#if !defined(__SSE2__)
+uint64_t mask_scalar(const char *a, const char *b) {
+    uint64_t m = 0;
+    for (unsigned w = 0; w < 8; ++w) {
+        uint64_t x, y;
+        memcpy(&x, a + w * 8, 8);
+        memcpy(&y, b + w * 8, 8);
+        if (x == y) continue;
+        for (unsigned k = 0; k < 8; ++k) {
+            if (a[w * 8 + k] != b[w * 8 + k]) m |= 1ULL << (w * 8 + k);
+        }
+    }
+    return m;
+}
+
+bool equal_scalar(const char *a, const char *b) {
+    return memcmp(a, b, 64) == 0;
+}
+#else
+uint64_t mask_sse2(const char *a, const char *b) {
+    uint64_t m = 0;
+    for (unsigned k = 0; k < 4; ++k) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + k * 16));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + k * 16));
+        m |= (uint64_t)(~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF) << (k * 16);
+    }
+    return m;
+}
+
+bool equal_sse2(const char *a, const char *b) {
+    __m128i d = _mm_setzero_si128();
+    for (unsigned k = 0; k < 4; ++k) {
+        d = _mm_or_si128(d, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + k * 16)),
+                                          _mm_loadu_si128((const __m128i *)(b + k * 16))));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())) == 0xFFFF;
+}
+#endif
+
+#ifdef BOOTUSB_X86_DISPATCH
+__attribute__((target("avx2"))) uint64_t mask_avx2(const char *a, const char *b) {
+    __m256i x0 = _mm256_loadu_si256((const __m256i *)a);
+    __m256i y0 = _mm256_loadu_si256((const __m256i *)b);
+    __m256i x1 = _mm256_loadu_si256((const __m256i *)(a + 32));
+    __m256i y1 = _mm256_loadu_si256((const __m256i *)(b + 32));
+    uint32_t lo = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0));
+    uint32_t hi = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1));
+    return (uint64_t)hi << 32 | lo;
+}
+
+__attribute__((target("avx2"))) bool equal_avx2(const char *a, const char *b) {
+    __m256i d = _mm256_or_si256(
+        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)a), _mm256_loadu_si256((const __m256i *)b)),
+        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + 32)), _mm256_loadu_si256((const __m256i *)(b + 32))));
+    return _mm256_testz_si256(d, d);
+}
+
+__attribute__((target("avx512bw"))) uint64_t mask_avx512(const char *a, const char *b) {
+    return _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a), _mm512_loadu_si512(b));
+}
+
+__attribute__((target("avx512bw"))) bool equal_avx512(const char *a, const char *b) {
+    return _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a), _mm512_loadu_si512(b)) == 0;
+}
+#endif
+
+// Equal blocks are the common case: skip them four at a time, and only
+// build a byte mask for a block that differs or an open range runs through
+template <uint64_t (*Mask)(const char *, const char *), bool (*Equal)(const char *, const char *)>
+bool compare_with(const char *a, const char *b, size_t len, ByteRanges &out, size_t base, size_t merge_gap) {
+    RangeBuilder ranges{out, merge_gap};
+    size_t i = 0;
+    while (i + 64 <= len) {
+        if (!ranges.open) {
+            while (i + 256 <= len && Equal(a + i, b + i) && Equal(a + i + 64, b + i + 64) &&
+                   Equal(a + i + 128, b + i + 128) && Equal(a + i + 192, b + i + 192)) {
+                i += 256;
+            }
+            while (i + 64 <= len && Equal(a + i, b + i)) i += 64;
+            if (i + 64 > len) break;
+        }
+        ranges.block(Mask(a + i, b + i), base + i);
+        i += 64;
+    }
+    for (; i < len; ++i) ranges.byte(a[i] != b[i], base + i);
+    if (ranges.open) ranges.close(base + len);
+    return !ranges.differs;
+}
+
+using CompareFn = bool (*)(const char *, const char *, size_t, ByteRanges &, size_t, size_t);
+
+struct Kernel {
+    CompareFn fn;
+    const char *name;
+};
+
+Kernel pick_kernel() {
+#ifdef BOOTUSB_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) return { compare_with<mask_avx512, equal_avx512>, "avx512" };
+    if (__builtin_cpu_supports("avx2")) return { compare_with<mask_avx2, equal_avx2>, "avx2" };
+#endif
+#if defined(__SSE2__)
+    return { compare_with<mask_sse2, equal_sse2>, "sse2" };
+#else
+    return { compare_with<mask_scalar, equal_scalar>, "scalar" };
+#endif
+}
+
+const Kernel &kernel() {
+    static const Kernel k = pick_kernel();
+    return k;
+}
+
+} // namespace
+
+bool compare_ranges(const char *a, const char *b, size_t len, ByteRanges &out, size_t base, size_t merge_gap) {
+    return kernel().fn(a, b, len, out, base, merge_gap);
+}
+
+const char *compare_kernel() {
+    return kernel().name;
+}
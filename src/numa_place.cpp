@@ -0,0 +1,130 @@
+#include "numa_place.h"
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+// From <numaif.h>, which needs libnuma
+static const int MPOL_DEFAULT_ = 0;
+static const int MPOL_PREFERRED_ = 1;
+static const unsigned long NODE_BITS = 16 * sizeof(unsigned long) * CHAR_BIT;
+
+static int read_int(const std::string &path, int fallback) {
+    std::ifstream f(path);
+    int v;
+    return (f >> v) ? v : fallback;
+}
+
+int device_numa_node(int fd, std::string *controller) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode)) return -1;
+    std::string link = "/sys/dev/block/" + std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev));
+    char real[PATH_MAX];
+    if (!realpath(link.c_str(), real)) return -1;
+
+    // .../pci0000:80/0000:80:14.0/usb2/2-1/.../block/sdb/sdb1: the USB and
+    // SCSI levels have no numa_node, the PCI host controller does
+    std::string dir = real;
+    while (dir.size() > strlen("/sys/devices")) {
+        int node = read_int(dir + "/numa_node", INT_MIN);
+        if (node != INT_MIN) {
+            if (controller) *controller = dir.substr(dir.rfind('/') + 1);
+            return node;
+        }
+        dir.erase(dir.rfind('/'));
+    }
+    return -1;
+}
+
+static int online_nodes() {
+    DIR *d = opendir("/sys/devices/system/node");
+    if (!d) return 1;
+    int count = 0;
+    while (struct dirent *e = readdir(d)) {
+        if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') count++;
+    }
+    closedir(d);
+    return count > 0 ? count : 1;
+}
+
+// Parses a cpulist such as "0-7,16-23"
+static bool node_cpus(int node, cpu_set_t &set, std::string &list) {
+    std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    if (!std::getline(f, list)) return false;
+    CPU_ZERO(&set);
+    const char *p = list.c_str();
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p) break;
+        long hi = lo;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) CPU_SET((int)c, &set);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(&set) > 0;
+}
+
+NodePlacement::NodePlacement(int fd, bool enabled) {
+    if (!enabled) {
+        std::cout << "NUMA placement disabled" << std::endl;
+        return;
+    }
+    int nodes = online_nodes();
+    if (nodes < 2) return;  // nothing to choose, and nothing worth logging
+
+    std::string controller;
+    node_ = device_numa_node(fd, &controller);
+    if (node_ < 0) {
+        std::cout << "NUMA placement: target's node is unknown, threads left to the scheduler" << std::endl;
+        return;
+    }
+
+    // Stay within whatever the process is allowed to run on (cpusets, taskset)
+    cpu_set_t wanted;
+    std::string list;
+    if (!node_cpus(node_, wanted, list) || sched_getaffinity(0, sizeof(previous_cpus_), &previous_cpus_) != 0) {
+        std::cout << "NUMA placement: no CPU list for node " << node_ << ", threads left to the scheduler" << std::endl;
+        return;
+    }
+    CPU_AND(&wanted, &wanted, &previous_cpus_);
+    if (CPU_COUNT(&wanted) == 0) {
+        std::cout << "NUMA placement: none of node " << node_ << "'s CPUs are available to this process" << std::endl;
+        return;
+    }
+    if (sched_setaffinity(0, sizeof(wanted), &wanted) != 0) {
+        std::cerr << "NUMA placement: could not pin to node " << node_ << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    pinned_ = true;
+
+    // Prefer, not bind: a full node still lets buffers come from elsewhere
+    if (syscall(SYS_get_mempolicy, &previous_policy_, previous_nodes_, NODE_BITS, nullptr, 0) == 0) {
+        unsigned long mask[16] = {};
+        if ((unsigned long)node_ < NODE_BITS) {
+            mask[node_ / (sizeof(unsigned long) * CHAR_BIT)] = 1UL << (node_ % (sizeof(unsigned long) * CHAR_BIT));
+            policy_set_ = syscall(SYS_set_mempolicy, MPOL_PREFERRED_, mask, NODE_BITS) == 0;
+        }
+    }
+    std::cout << "NUMA placement: target on node " << node_ << " (controller " << controller << "), job pinned to "
+              << CPU_COUNT(&wanted) << " CPUs of " << list << (policy_set_ ? ", buffers preferred from that node" : "")
+              << std::endl;
+}
+
+NodePlacement::~NodePlacement() {
+    if (policy_set_) {
+        if (previous_policy_ == MPOL_DEFAULT_) {
+            syscall(SYS_set_mempolicy, MPOL_DEFAULT_, nullptr, 0);
+        } else {
+            syscall(SYS_set_mempolicy, previous_policy_, previous_nodes_, NODE_BITS);
+        }
+    }
+    if (pinned_) sched_setaffinity(0, sizeof(previous_cpus_), &previous_cpus_);
+}
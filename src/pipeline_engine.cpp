@@ -0,0 +1,157 @@
+#include "pipeline_engine.h"
+#include "spsc_ring.h"
+#include "buffer_pool.h"
+#include "io_util.h"
+#include "autotune.h"
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+namespace {
+
+struct Chunk {
+    char *buf = nullptr;   // nullptr marks end of stream
+    size_t len = 0;
+};
+
+// Spin briefly, then yield, then nap: keeps the handoff latency far below
+// one chunk's I/O time without burning a core while the other side is slow.
+void backoff(unsigned &spins) {
+    ++spins;
+    if (spins < 64) return;
+    if (spins < 128) {
+        std::this_thread::yield();
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(20));
+}
+
+} // namespace
+
+bool pipeline_copy(int ifd, const ChunkSink &sink, size_t length, size_t chunk_size, unsigned ring_depth,
+                   std::function<void(size_t, size_t)> progress_callback,
+                   PipelineStats *stats, std::function<bool()> should_stop, ChunkSink on_read,
+                   ChunkTuner *tuner) {
+    const size_t CHUNK = chunk_size > 0 ? chunk_size : 4 * 1024 * 1024;
+    const unsigned DEPTH = std::max(2u, std::min(ring_depth, 64u));
+
+    std::vector<char *> buffers;
+    for (unsigned i = 0; i < DEPTH; ++i) {
+        char *p = buffer_pool_acquire(CHUNK);
+        if (!p) break;
+        buffers.push_back(p);
+    }
+    auto release = [&]() { for (char *p : buffers) buffer_pool_release(p, CHUNK); };
+    if (buffers.size() != DEPTH) {
+        std::cerr << "pipeline buffer allocation failed" << std::endl;
+        release();
+        return false;
+    }
+
+    SpscRing<Chunk> filled(DEPTH + 1);   // reader -> writer, plus room for the end marker
+    SpscRing<Chunk> empty(DEPTH);        // writer -> reader
+    for (char *p : buffers) empty.try_push(Chunk{ p, 0 });
+
+    std::atomic<bool> stop{false};
+    std::atomic<int> read_error{0};
+    std::atomic<size_t> reader_waits{0};
+
+    std::thread reader([&]() {
+        size_t offset = 0;
+        while (offset < length && !stop.load(std::memory_order_relaxed)) {
+            Chunk c;
+            if (!empty.try_pop(c)) {
+                reader_waits.fetch_add(1, std::memory_order_relaxed);
+                unsigned spins = 0;
+                while (!empty.try_pop(c)) {
+                    if (stop.load(std::memory_order_relaxed)) return;
+                    backoff(spins);
+                }
+            }
+            ssize_t r = read_full(ifd, c.buf, std::min(CHUNK, length - offset));
+            if (r <= 0) {
+                read_error.store(r < 0 ? errno : EIO);
+                break;
+            }
+            c.len = (size_t)r;
+            if (on_read && !on_read(c.buf, c.len, offset)) {
+                read_error.store(errno ? errno : EIO);
+                break;
+            }
+            offset += c.len;
+            filled.try_push(c);   // never full: at most DEPTH buffers exist
+        }
+        filled.try_push(Chunk{});
+    });
+
+    size_t written = 0;
+    size_t samples = 0;
+    size_t occupancy_sum = 0;
+    size_t writer_waits = 0;
+    bool ok = true;
+
+    for (;;) {
+        Chunk c;
+        if (!filled.try_pop(c)) {
+            ++writer_waits;
+            unsigned spins = 0;
+            while (!filled.try_pop(c)) {
+                if (should_stop && should_stop()) break;
+                backoff(spins);
+            }
+        }
+        if (!c.buf && should_stop && should_stop()) {
+            ok = false;
+            break;
+        }
+        if (!c.buf) break;
+        // Occupancy as seen when the writer picks up work, counting this chunk
+        occupancy_sum += filled.size() + 1;
+        ++samples;
+
+        // The tuner lives on this thread: the reader keeps filling whole buffers
+        size_t piece = tuner ? std::min(tuner->chunk(), c.len) : c.len;
+        for (size_t pos = 0; ok && pos < c.len; pos += piece) {
+            size_t n = std::min(piece, c.len - pos);
+            auto write_start = std::chrono::steady_clock::now();
+            if (!sink(c.buf + pos, n, written)) {
+                std::cerr << "Error writing to USB: " << strerror(errno) << std::endl;
+                ok = false;
+                break;
+            }
+            if (tuner) {
+                tuner->record(n, std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - write_start).count());
+            }
+            written += n;
+            if (progress_callback) progress_callback(written, length);
+        }
+        if (!ok) break;
+        empty.try_push(c);
+    }
+
+    stop.store(true);
+    reader.join();
+    release();
+
+    if (ok && read_error.load() != 0) {
+        std::cerr << "Error reading ISO: " << strerror(read_error.load()) << std::endl;
+        ok = false;
+    }
+
+    PipelineStats local;
+    local.capacity = DEPTH;
+    local.avg_occupancy = samples ? (double)occupancy_sum / samples : 0.0;
+    local.writer_waits = writer_waits;
+    local.reader_waits = reader_waits.load();
+    std::cout << "Pipeline ring: average occupancy " << local.avg_occupancy << "/" << DEPTH
+              << ", writer waited " << local.writer_waits << "x, reader waited " << local.reader_waits << "x ("
+              << (local.avg_occupancy >= DEPTH / 2.0 ? "device" : "source") << "-bound)" << std::endl;
+    if (stats) *stats = local;
+    return ok;
+}
@@ -0,0 +1,228 @@
+#include "quick_verify.h"
+#include "readback.h"
+#include "buffer_pool.h"
+#include "image_cache.h"
+#include "memscan.h"
+#include "job_control.h"
+#include "io_util.h"
+#include <iostream>
+#include <set>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Sampling unit: large enough to read efficiently, small enough that a
+// sample of thousands stays a fraction of a big image
+static const size_t BLOCK = 64 * 1024;
+static const size_t BOOT_AREA = 1024 * 1024;
+static const size_t SECTOR = 512;
+static const size_t ISO_SECTOR = 2048;
+static const size_t MISMATCH_MERGE_GAP = 512;
+// GPT entries are 128 bytes in practice; anything far outside that is a
+// damaged or hostile header, not a table to allocate for
+static const uint32_t GPT_MAX_ENTRY = 4096;
+static const size_t GPT_MAX_TABLE = 4 * 1024 * 1024;
+
+static uint32_t le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t le64(const unsigned char *p) {
+    return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+static bool read_at(int fd, unsigned char *buf, size_t len, size_t offset) {
+    return pread(fd, buf, len, (off_t)offset) == (ssize_t)len;
+}
+
+// Blocks holding what a boot depends on, found by parsing the image itself
+static std::set<size_t> boot_blocks(int ifd, size_t total) {
+    std::set<size_t> blocks;
+    auto add = [&](size_t offset, size_t len) {
+        if (offset >= total) return;
+        size_t end = std::min(offset + len, total);
+        for (size_t b = offset / BLOCK; b * BLOCK < end; ++b) blocks.insert(b);
+    };
+    // MBR, GPT and the ISO 9660 system area and volume descriptors up front;
+    // the backup GPT of a hybrid image at the end
+    add(0, BOOT_AREA);
+    add(total > BOOT_AREA ? total - BOOT_AREA : 0, BOOT_AREA);
+
+    unsigned char sec[SECTOR];
+    if (read_at(ifd, sec, SECTOR, 0) && sec[510] == 0x55 && sec[511] == 0xAA) {
+        bool protective = false;
+        for (int i = 0; i < 4; ++i) {
+            const unsigned char *e = sec + 446 + i * 16;
+            if (e[4] == 0xEE) protective = true;
+            else if (e[4] != 0) add((size_t)le32(e + 8) * SECTOR, BLOCK);
+        }
+        unsigned char gpt[SECTOR];
+        if (protective && read_at(ifd, gpt, SECTOR, SECTOR) && memcmp(gpt, "EFI PART", 8) == 0) {
+            uint64_t entries_lba = le64(gpt + 72);
+            uint32_t count = std::min(le32(gpt + 80), 1024u);
+            uint32_t size = le32(gpt + 84);
+            size_t table_bytes = (size_t)count * size;
+            bool sane = size >= 128 && size <= GPT_MAX_ENTRY && table_bytes <= GPT_MAX_TABLE &&
+                        entries_lba < total / SECTOR && table_bytes <= total - entries_lba * SECTOR;
+            std::vector<unsigned char> table(sane ? table_bytes : 0);
+            if (sane && read_at(ifd, table.data(), table.size(), entries_lba * SECTOR)) {
+                for (uint32_t i = 0; i < count; ++i) {
+                    const unsigned char *e = table.data() + (size_t)i * size;
+                    static const unsigned char unused[16] = {};
+                    if (memcmp(e, unused, 16) != 0) add((size_t)le64(e + 32) * SECTOR, BLOCK);
+                }
+            }
+        }
+    }
+
+    // El Torito: the boot record descriptor points at the boot catalog, whose
+    // default entry points at the boot image
+    unsigned char vd[ISO_SECTOR];
+    if (read_at(ifd, vd, ISO_SECTOR, 17 * ISO_SECTOR) && vd[0] == 0 && memcmp(vd + 1, "CD001", 5) == 0 &&
+        memcmp(vd + 7, "EL TORITO SPECIFICATION", 23) == 0) {
+        size_t catalog = (size_t)le32(vd + 0x47) * ISO_SECTOR;
+        add(catalog, ISO_SECTOR);
+        unsigned char cat[64];
+        if (read_at(ifd, cat, sizeof(cat), catalog) && cat[32] == 0x88) {
+            add((size_t)le32(cat + 32 + 8) * ISO_SECTOR, BLOCK);
+        }
+    }
+    return blocks;
+}
+
+// Smallest sample that catches a defect rate of defect_fraction with
+// probability detect: 1 - (1 - f)^n >= P
+static size_t sample_size(double detect, double defect_fraction) {
+    return (size_t)std::ceil(std::log(1 - detect) / std::log(1 - defect_fraction));
+}
+
+bool quick_verify(const std::string &iso_path, const std::string &usb_path, double detect, double defect_fraction,
+                  uint64_t seed, std::function<void(size_t, size_t)> progress_callback,
+                  const CancelToken *cancel, QuickVerifyResult *result) {
+    // The sample size and the reported bound both use the clamped values
+    detect = std::min(std::max(detect, 0.5), 0.999999);
+    defect_fraction = std::min(std::max(defect_fraction, 1e-7), 0.5);
+    QuickVerifyResult local;
+    QuickVerifyResult &res = result ? *result : local;
+    res = QuickVerifyResult();
+
+    int ifd = open(iso_path.c_str(), O_RDONLY);
+    if (ifd < 0) return false;
+    struct stat st;
+    if (fstat(ifd, &st) != 0) {
+        close(ifd);
+        return false;
+    }
+    size_t total = (size_t)st.st_size;
+    int cached = image_cache_open(iso_path, [cancel]() { return cancel && cancel->cancelled(); });
+    if (cached >= 0) {
+        close(ifd);
+        ifd = cached;
+    }
+
+    int fd = open(usb_path.c_str(), O_RDONLY);
+    if (fd >= 0) flush_and_drop(fd);
+    int dfd = open(usb_path.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+        close(ifd);
+        return false;
+    }
+    // Sampled blocks are BLOCK-aligned; only a partial last block needs the page cache
+    if (dfd >= 0 && BLOCK % logical_block_size(dfd) != 0) {
+        close(dfd);
+        dfd = -1;
+    }
+
+    std::set<size_t> chosen = boot_blocks(ifd, total);
+    res.blocks = (total + BLOCK - 1) / BLOCK;
+    res.boot_blocks = chosen.size();
+
+    if (seed == 0) {
+        seed = ((uint64_t)std::random_device()() << 32) ^
+               (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    res.seed = seed;
+    size_t want = sample_size(detect, defect_fraction);
+    size_t others = res.blocks - chosen.size();
+    if (want * 2 > others) {
+        // Sampling most of the image costs about as much as reading all of it
+        for (size_t b = 0; b < res.blocks; ++b) chosen.insert(b);
+        res.sampled = others;
+    } else {
+        // Rejection sampling stays cheap: the sample is at most half the blocks
+        std::mt19937_64 rng(seed);
+        std::uniform_int_distribution<size_t> pick(0, res.blocks - 1);
+        size_t target = chosen.size() + want;
+        while (chosen.size() < target) chosen.insert(pick(rng));
+        res.sampled = want;
+    }
+    const char *how = dfd >= 0 ? "O_DIRECT" : "buffered reads after dropping cached pages";
+    if (res.sampled == others) {
+        std::cout << "Quick verify: the sample would cover most of the image, reading all " << res.blocks
+                  << " blocks with " << how << std::endl;
+    } else {
+        std::cout << "Quick verify: " << res.boot_blocks << " boot-area and " << res.sampled << " random "
+                  << (BLOCK / 1024) << "KB blocks of " << res.blocks << " (seed " << seed << "), reading with "
+                  << how << std::endl;
+    }
+    size_t to_read = chosen.size() * BLOCK;
+    if (total % BLOCK && chosen.count(res.blocks - 1)) to_read -= BLOCK - total % BLOCK;
+
+    PoolBuffer dev_buf(BLOCK);
+    PoolBuffer iso_buf(BLOCK);
+    bool ok = dev_buf && iso_buf;
+    size_t done = 0;  // bytes
+    // In offset order, so the device sees a forward sweep
+    for (size_t b : chosen) {
+        if (!ok) break;
+        if (cancel && cancel->cancelled()) {
+            ok = false;
+            break;
+        }
+        size_t offset = b * BLOCK;
+        size_t len = std::min(BLOCK, total - offset);
+        int rfd = dfd >= 0 && len == BLOCK ? dfd : fd;
+        if (pread(rfd, dev_buf.data(), len, (off_t)offset) != (ssize_t)len ||
+            pread(ifd, iso_buf.data(), len, (off_t)offset) != (ssize_t)len) {
+            std::cerr << "Quick verify: read error at offset " << offset << ": " << strerror(errno) << std::endl;
+            ok = false;
+            break;
+        }
+        compare_ranges(iso_buf.data(), dev_buf.data(), len, res.mismatches, offset, MISMATCH_MERGE_GAP);
+        done += len;
+        if (progress_callback) progress_callback(done, to_read);
+    }
+    close(ifd);
+    close(fd);
+    if (dfd >= 0) close(dfd);
+
+    if (cancel && cancel->cancelled()) {
+        std::cerr << "Quick verify cancelled" << std::endl;
+        return false;
+    }
+    if (!ok) return false;
+    if (!res.mismatches.empty()) {
+        std::cerr << "Quick verify: " << res.mismatches.size() << " corrupt extent"
+                  << (res.mismatches.size() == 1 ? "" : "s") << ", the first at offset " << res.mismatches[0].first
+                  << " (seed " << seed << ")" << std::endl;
+        return false;
+    }
+
+    // Zero failures in n draws: with confidence detect, the corrupt fraction
+    // is below 1 - (1 - detect)^(1/n); a full read leaves no doubt
+    if (res.sampled == others) {
+        res.corrupt_bound = 0;
+        std::cout << "Quick verify: every block matched" << std::endl;
+    } else {
+        res.corrupt_bound = 1 - std::pow(1 - detect, 1.0 / (double)res.sampled);
+        std::cout << "Quick verify: all sampled blocks matched; with " << detect * 100 << "% confidence fewer than "
+                  << res.corrupt_bound * 100 << "% of the blocks are corrupt" << std::endl;
+    }
+    return true;
+}
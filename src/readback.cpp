@@ -0,0 +1,152 @@
+#include "readback.h"
+#include "uring_engine.h"
+#include "buffer_pool.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+
+static const unsigned READ_DEPTH = 8;
+static const size_t MIN_READ_CHUNK = 512 * 1024;
+
+void flush_and_drop(int fd) {
+    struct stat st;
+    bool block = fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+    fsync(fd);
+    // For a block device BLKFLSBUF also flushes the kernel's buffer cache
+    if (!block || ioctl(fd, BLKFLSBUF, 0) != 0) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// The block layer splits reads at max_sectors_kb; a few of those per chunk
+// keep each request large without delaying the first completion
+static size_t read_chunk(const struct stat &st) {
+    if (!S_ISBLK(st.st_mode)) return 1024 * 1024;
+    std::ifstream f("/sys/dev/block/" + std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev)) +
+                    "/queue/max_sectors_kb");
+    size_t kb = 0;
+    if (!(f >> kb) || kb == 0) {
+        // Partitions keep their queue attributes on the parent disk
+        std::ifstream p("/sys/dev/block/" + std::to_string(major(st.st_rdev)) + ":" +
+                        std::to_string(minor(st.st_rdev)) + "/../queue/max_sectors_kb");
+        if (!(p >> kb) || kb == 0) return 1024 * 1024;
+    }
+    return std::min(std::max(kb * 1024 * 4, MIN_READ_CHUNK), READBACK_MAX_CHUNK);
+}
+
+// Reads len bytes at offset piece by piece after the whole read failed,
+// zero-filling and reporting the pieces the device cannot return
+static void salvage(int fd, char *buf, size_t len, size_t offset,
+                    const std::function<void(size_t, size_t)> &unreadable) {
+    for (size_t pos = 0; pos < len; pos += READBACK_SALVAGE_PIECE) {
+        size_t n = std::min(READBACK_SALVAGE_PIECE, len - pos);
+        if (pread(fd, buf + pos, n, (off_t)(offset + pos)) != (ssize_t)n) {
+            memset(buf + pos, 0, n);
+            unreadable(offset + pos, n);
+        }
+    }
+}
+
+// pread of a whole chunk, salvaging it piecewise on an error when the caller
+// wants the read to go on
+static bool read_chunk_at(int fd, char *buf, size_t len, size_t offset,
+                          const std::function<void(size_t, size_t)> &unreadable) {
+    if (pread(fd, buf, len, (off_t)offset) == (ssize_t)len) return true;
+    if (!unreadable) return false;
+    salvage(fd, buf, len, offset, unreadable);
+    return true;
+}
+
+bool read_back(const std::string &path, size_t length, const ChunkSink &consumer,
+               std::function<bool()> should_stop, std::function<void(size_t, size_t)> unreadable) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    flush_and_drop(fd);
+
+    int dfd = open(path.c_str(), O_RDONLY | O_DIRECT);
+    if (dfd < 0) {
+        std::cout << "Readback: buffered, after dropping cached pages (O_DIRECT unavailable: "
+                  << strerror(errno) << ")" << std::endl;
+    }
+
+    // The last partial block is read through the page cache unless rounding
+    // it up stays within the target
+    size_t body = length;
+    if (dfd >= 0) {
+        size_t lbs = logical_block_size(dfd);
+        off_t end = lseek(dfd, 0, SEEK_END);
+        size_t up = (length + lbs - 1) / lbs * lbs;
+        body = end >= 0 && (size_t)end >= up ? up : length / lbs * lbs;
+    }
+    size_t chunk = read_chunk(st);
+    // Whether the consumer asked to stop
+    bool refused = false;
+    auto clipped = [&](const char *buf, size_t len, size_t offset) {
+        if (offset >= length) return true;
+        refused = !consumer(buf, std::min(len, length - offset), offset);
+        return !refused;
+    };
+
+    bool ok = true;
+    if (dfd >= 0 && uring_engine_available()) {
+        std::cout << "Readback: O_DIRECT, io_uring queue depth " << READ_DEPTH << ", "
+                  << (chunk / 1024) << "KB reads" << std::endl;
+        size_t failed = body;
+        ok = uring_read(dfd, 0, body, chunk, READ_DEPTH, clipped, should_stop, &failed);
+        // A read error: the chunks before it are delivered, so salvage only the
+        // chunk that failed, then carry on with the queue after it
+        while (!ok && unreadable && !refused && failed < body && !(should_stop && should_stop())) {
+            PoolBuffer buf(chunk);
+            if (!buf) break;
+            size_t at = failed;
+            size_t len = std::min(chunk, body - at);
+            salvage(dfd, buf.data(), len, at, unreadable);
+            if (!clipped(buf.data(), len, at)) break;
+            failed = body;
+            ok = at + len >= body ||
+                 uring_read(dfd, at + len, body - at - len, chunk, READ_DEPTH, clipped, should_stop, &failed);
+        }
+    } else if (dfd >= 0) {
+        std::cout << "Readback: O_DIRECT, sequential " << (chunk / 1024) << "KB reads (io_uring unavailable)" << std::endl;
+        PoolBuffer buf(chunk);
+        ok = (bool)buf;
+        for (size_t off = 0; ok && off < body; off += chunk) {
+            if (should_stop && should_stop()) {
+                ok = false;
+                break;
+            }
+            size_t len = std::min(chunk, body - off);
+            ok = read_chunk_at(dfd, buf.data(), len, off, unreadable) && clipped(buf.data(), len, off);
+        }
+    } else {
+        body = 0;
+    }
+
+    // Unaligned tail, or everything when O_DIRECT is not available
+    if (ok && body < length) {
+        PoolBuffer buf(chunk);
+        ok = (bool)buf;
+        for (size_t off = body; ok && off < length; off += chunk) {
+            if (should_stop && should_stop()) {
+                ok = false;
+                break;
+            }
+            size_t len = std::min(chunk, length - off);
+            ok = read_chunk_at(fd, buf.data(), len, off, unreadable) && consumer(buf.data(), len, off);
+        }
+    }
+    if (dfd >= 0) close(dfd);
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,76 @@
+#include "removal_watch.h"
+#include <libudev.h>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+RemovalWatch::RemovalWatch(const std::string &devnode) {
+    struct stat st;
+    if (stat(devnode.c_str(), &st) != 0 || !S_ISBLK(st.st_mode)) return;
+
+    udev_ = udev_new();
+    if (!udev_) return;
+    struct udev_device *dev = udev_device_new_from_devnum(udev_, 'b', st.st_rdev);
+    if (!dev) return;
+    devnum_ = disknum_ = st.st_rdev;
+    struct udev_device *disk = udev_device_get_parent_with_subsystem_devtype(dev, "block", "disk");
+    if (disk) disknum_ = udev_device_get_devnum(disk);
+    udev_device_unref(dev);
+
+    // Subscribe before the job starts so no event can slip in between
+    monitor_ = udev_monitor_new_from_netlink(udev_, "udev");
+    if (!monitor_) return;
+    udev_monitor_filter_add_match_subsystem_devtype(monitor_, "block", nullptr);
+    if (udev_monitor_enable_receiving(monitor_) < 0) return;
+    stop_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd_ < 0) return;
+    thread_ = std::thread(&RemovalWatch::run, this);
+}
+
+RemovalWatch::~RemovalWatch() {
+    if (thread_.joinable()) {
+        uint64_t one = 1;
+        if (write(stop_fd_, &one, sizeof(one)) == (ssize_t)sizeof(one)) thread_.join();
+        else thread_.detach();
+    }
+    if (stop_fd_ >= 0) close(stop_fd_);
+    if (monitor_) udev_monitor_unref(monitor_);
+    if (udev_) udev_unref(udev_);
+}
+
+static long long now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long long RemovalWatch::since_removal_ms() const {
+    if (!removed()) return 0;
+    return now_ms() - removed_at_.load(std::memory_order_relaxed);
+}
+
+void RemovalWatch::run() {
+    struct pollfd fds[2] = {
+        { udev_monitor_get_fd(monitor_), POLLIN, 0 },
+        { stop_fd_, POLLIN, 0 },
+    };
+    while (poll(fds, 2, -1) >= 0 || errno == EINTR) {
+        if (fds[1].revents) return;
+        if (!(fds[0].revents & POLLIN)) continue;
+        struct udev_device *dev = udev_monitor_receive_device(monitor_);
+        if (!dev) continue;
+        const char *action = udev_device_get_action(dev);
+        unsigned long long num = udev_device_get_devnum(dev);
+        bool gone = action && strcmp(action, "remove") == 0 && (num == devnum_ || num == disknum_);
+        udev_device_unref(dev);
+        if (gone) {
+            removed_at_.store(now_ms(), std::memory_order_relaxed);
+            removed_.store(true, std::memory_order_release);
+            return;
+        }
+    }
+}
@@ -0,0 +1,174 @@
+#include "sha256.h"
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define BOOTUSB_X86_DISPATCH 1
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void Sha256::reset() {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(h_, init, sizeof(h_));
+    buf_len_ = 0;
+    total_ = 0;
+}
+
+static void block_scalar(uint32_t state[8], const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + S1 + ch + K[i] + w[i];
+        uint32_t S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = S0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+#ifdef BOOTUSB_X86_DISPATCH
+// SHA extensions: two rounds per sha256rnds2, with the message schedule in
+// sha256msg1/msg2. The state lives as ABEF/CDGH halves while blocks run.
+__attribute__((target("sha,sse4.1,ssse3")))
+static void blocks_shani(uint32_t h[8], const uint8_t *p, size_t n) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xB1);  // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1B);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);        // CDGH
+
+    for (; n > 0; --n, p += 64) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i w[16];
+        for (int g = 0; g < 16; ++g) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * g)), bswap);
+            } else {
+                __m128i t = _mm_add_epi32(_mm_sha256msg1_epu32(w[g - 4], w[g - 3]), _mm_alignr_epi8(w[g - 1], w[g - 2], 4));
+                w[g] = _mm_sha256msg2_epu32(t, w[g - 1]);
+            }
+            __m128i msg = _mm_add_epi32(w[g], _mm_loadu_si128((const __m128i *)&K[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);     // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);  // DCHG
+    _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xF0));  // DCBA
+    _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8));     // HGFE
+}
+
+static bool has_shani() {
+    unsigned a, b, c, d;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    __builtin_cpu_init();
+    return (b & bit_SHA) && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+static void blocks_scalar(uint32_t h[8], const uint8_t *p, size_t n) {
+    for (; n > 0; --n, p += 64) block_scalar(h, p);
+}
+
+using BlocksFn = void (*)(uint32_t *, const uint8_t *, size_t);
+
+static BlocksFn pick_blocks() {
+#ifdef BOOTUSB_X86_DISPATCH
+    if (has_shani()) return blocks_shani;
+#endif
+    return blocks_scalar;
+}
+
+static BlocksFn blocks_fn() {
+    static const BlocksFn fn = pick_blocks();
+    return fn;
+}
+
+bool Sha256::accelerated() {
+    return blocks_fn() != blocks_scalar;
+}
+
+void Sha256::blocks(const uint8_t *p, size_t n) {
+    blocks_fn()(h_, p, n);
+}
+
+void Sha256::update(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    total_ += len;
+    if (buf_len_) {
+        size_t n = 64 - buf_len_ < len ? 64 - buf_len_ : len;
+        memcpy(buf_ + buf_len_, p, n);
+        buf_len_ += n;
+        p += n;
+        len -= n;
+        if (buf_len_ < 64) return;
+        blocks(buf_, 1);
+        buf_len_ = 0;
+    }
+    blocks(p, len / 64);
+    p += len / 64 * 64;
+    len %= 64;
+    memcpy(buf_, p, len);
+    buf_len_ = len;
+}
+
+void Sha256::finish(uint8_t out[32]) {
+    uint64_t bits = total_ * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (buf_len_ < 56 ? 56 : 120) - buf_len_;
+    for (int i = 0; i < 8; ++i) pad[pad_len + i] = (uint8_t)(bits >> (56 - 8 * i));
+    update(pad, pad_len + 8);
+    for (int i = 0; i < 8; ++i) {
+        out[i * 4] = (uint8_t)(h_[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(h_[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(h_[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)h_[i];
+    }
+}
+
+void Sha256::digest(const void *data, size_t len, uint8_t out[32]) {
+    Sha256 ctx;
+    ctx.update(data, len);
+    ctx.finish(out);
+}
+
+std::string Sha256::hex(const uint8_t digest[32]) {
+    static const char *digits = "0123456789abcdef";
+    std::string s(64, '0');
+    for (int i = 0; i < 32; ++i) {
+        s[i * 2] = digits[digest[i] >> 4];
+        s[i * 2 + 1] = digits[digest[i] & 15];
+    }
+    return s;
+}
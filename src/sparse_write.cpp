@@ -0,0 +1,154 @@
+#include "sparse_write.h"
+#include "memscan.h"
+#include "io_util.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+// Zero detection granularity inside a chunk
+static const size_t RUN_BLOCK = 64 * 1024;
+
+// Read a queue attribute of the block device behind fd; partitions keep
+// their queue directory on the parent disk
+static unsigned long long queue_attr(int fd, const char *attr) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 0;
+    std::string dev = "/sys/dev/block/" + std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev));
+    for (const char *dir : { "/queue/", "/../queue/" }) {
+        std::ifstream in(dev + dir + attr);
+        unsigned long long value = 0;
+        if (in >> value) return value;
+    }
+    return 0;
+}
+
+bool SparseWriter::prepare(size_t total) {
+    struct stat st;
+    if (fstat(fd_, &st) != 0) return false;
+
+    if (S_ISREG(st.st_mode)) {
+        // Holes read back as zero; make sure the file spans the whole image
+        if ((size_t)st.st_size < total && ftruncate(fd_, (off_t)total) != 0) {
+            std::cerr << "Error sizing target file: " << strerror(errno) << std::endl;
+            return false;
+        }
+        method_ = PUNCH;
+        zero_until_ = total;
+        std::cout << "Sparse write: zero runs become holes" << std::endl;
+        return true;
+    }
+
+    if (!S_ISBLK(st.st_mode)) {
+        std::cout << "Sparse write: target cannot clear ranges, writing zeros" << std::endl;
+        return true;
+    }
+
+    block_ = logical_block_size(fd_);
+    zero_until_ = total / block_ * block_;
+
+    // BLKDISCARDZEROES reads 0 on every kernel since 4.12, so discard never
+    // guarantees zeroes; BLKZEROOUT does, and uses the device's WRITE ZEROES
+    // (which may unmap) when it has one
+    method_ = ZERO_OUT;
+    offloaded_ = queue_attr(fd_, "write_zeroes_max_bytes") > 0;
+    std::cout << "Sparse write: zero runs via BLKZEROOUT ("
+              << (offloaded_ ? "offloaded to the device" : "not offloaded, kernel writes zeros") << ")" << std::endl;
+    return true;
+}
+
+bool SparseWriter::clear_run(size_t offset, size_t len) {
+    switch (method_) {
+    case PUNCH:
+        return fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len) == 0;
+    case ZERO_OUT: {
+        uint64_t range[2] = { offset, len };
+        return ioctl(fd_, BLKZEROOUT, range) == 0;
+    }
+    }
+    return false;
+}
+
+bool SparseWriter::write(const char *buf, size_t len, size_t offset) {
+    size_t pos = 0;
+    while (pos < len) {
+        // Extend a run of blocks that are all zero or all data
+        size_t end = pos + std::min(RUN_BLOCK, len - pos);
+        bool zero = is_zero(buf + pos, end - pos);
+        while (end < len) {
+            size_t n = std::min(RUN_BLOCK, len - end);
+            if (is_zero(buf + end, n) != zero) break;
+            end += n;
+        }
+
+        size_t run_offset = offset + pos;
+        size_t run_len = end - pos;
+        bool clearable = zero && run_offset + run_len <= zero_until_
+                         && run_offset % block_ == 0 && run_len % block_ == 0;
+        if (clearable && clear_run(run_offset, run_len)) {
+            elided_ += run_len;
+        } else {
+            if (clearable) {
+                // The target refused; stop trying and write zeros from here on
+                std::cerr << "Clearing range failed (" << strerror(errno) << "), writing zeros" << std::endl;
+                zero_until_ = 0;
+            }
+            if (!out_(buf + pos, run_len, run_offset)) return false;
+        }
+        pos = end;
+    }
+    return true;
+}
+
+void SparseWriter::report() const {
+    const char *how = method_ == PUNCH ? "left as holes" : "zeroed out";
+    std::cout << "Sparse write: " << (elided_ / (1024 * 1024)) << "MB of zero runs " << how
+              << " instead of written" << std::endl;
+}
+
+bool prepare_image_file(int fd, int src_fd, size_t image_size, size_t target_size, bool keep_contents) {
+    size_t size = std::max(image_size, target_size);
+    struct stat st;
+    if (keep_contents && fstat(fd, &st) == 0) size = std::max(size, (size_t)st.st_size);
+    if ((!keep_contents && ftruncate(fd, 0) != 0) || ftruncate(fd, (off_t)size) != 0) {
+        std::cerr << "Error sizing image file: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Walk the source's data extents; a source without SEEK_DATA support is one
+    // extent. Kept contents keep their layout, holes included.
+    size_t reserved = 0;
+    off_t pos = keep_contents ? (off_t)image_size : 0;
+    while ((size_t)pos < image_size) {
+        off_t data = lseek(src_fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break;   // only a hole left
+            data = pos;
+        }
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0 || (size_t)hole > image_size) hole = (off_t)image_size;
+        if (fallocate(fd, 0, data, hole - data) != 0) {
+            if (errno != EOPNOTSUPP) {
+                std::cerr << "Preallocation failed: " << strerror(errno) << std::endl;
+            }
+            break;
+        }
+        reserved += (size_t)(hole - data);
+        pos = hole;
+    }
+    lseek(src_fd, 0, SEEK_SET);
+
+    std::cout << "Image file target: " << (size / (1024 * 1024)) << "MB file, "
+              << (reserved / (1024 * 1024)) << "MB preallocated for the image's data" << std::endl;
+    return true;
+}
@@ -0,0 +1,186 @@
+#include "trail_verify.h"
+#include "image_digest.h"
+#include "uring_engine.h"
+#include "buffer_pool.h"
+#include "io_util.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const size_t CHUNK = 1024 * 1024;
+// Shallower than a full readback: the writer shares the device
+static const unsigned DEPTH = 4;
+// How often a waiting verifier checks should_stop
+static const auto POLL = std::chrono::milliseconds(50);
+
+TrailingVerifier::TrailingVerifier(const std::string &target, int ifd, size_t total, const ImageDigest *digest,
+                                   size_t window, std::function<bool()> should_stop)
+    : target_(target), ifd_(ifd), total_(total), digest_(digest), window_(std::max(window, CHUNK)),
+      should_stop_(should_stop) {}
+
+TrailingVerifier::~TrailingVerifier() {
+    stop();
+    if (image_buf_) buffer_pool_release(image_buf_, CHUNK);
+    if (dfd_ >= 0) close(dfd_);
+    if (fd_ >= 0) close(fd_);
+}
+
+bool TrailingVerifier::start() {
+    dfd_ = open(target_.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+    fd_ = open(target_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dfd_ < 0 || fd_ < 0) {
+        std::cerr << "Verify while writing: cannot read the target with O_DIRECT ("
+                  << strerror(errno) << "), verifying afterwards" << std::endl;
+        return false;
+    }
+    block_size_ = logical_block_size(dfd_);
+    use_uring_ = uring_engine_available();
+    if (!digest_) {
+        image_buf_ = buffer_pool_acquire(CHUNK);
+        if (!image_buf_) return false;
+    }
+    std::cout << "Verifying while writing: reading back in " << (window_ / (1024*1024)) << "MB batches behind the "
+              << "durable point, checking against the " << (digest_ ? "image digest" : "image") << std::endl;
+    thread_ = std::thread(&TrailingVerifier::run, this);
+    return true;
+}
+
+void TrailingVerifier::durable(size_t upto) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (upto <= durable_) return;
+        durable_ = std::min(upto, total_);
+    }
+    cv_.notify_one();
+}
+
+bool TrailingVerifier::finish() {
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finishing_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) thread_.join();
+    if (failed() || inconclusive_ || verified() < total_) return false;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Verified while writing: all " << (total_ / (1024*1024)) << "MB matched, " << ms
+              << "ms after the final flush" << std::endl;
+    return true;
+}
+
+void TrailingVerifier::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) thread_.join();
+}
+
+void TrailingVerifier::fail(size_t offset) {
+    failed_at_ = offset;
+    failed_.store(true);
+    std::cerr << "Verify while writing: " << (digest_ ? "block" : "data") << " at offset " << offset
+              << " differs from the image" << std::endl;
+}
+
+bool TrailingVerifier::check(const char *buf, size_t len, size_t offset) {
+    if (!digest_) {
+        if (pread(ifd_, image_buf_, len, (off_t)offset) != (ssize_t)len) {
+            std::cerr << "Verify while writing: error reading the image: " << strerror(errno) << std::endl;
+            inconclusive_ = true;
+            return false;
+        }
+        if (memcmp(buf, image_buf_, len) != 0) {
+            fail(offset + (size_t)(std::mismatch(buf, buf + len, image_buf_).first - buf));
+            return false;
+        }
+        verified_.store(offset + len);
+        return true;
+    }
+
+    size_t end = offset + len;
+    while (offset < end) {
+        size_t block_end = std::min((offset / ImageDigest::BLOCK + 1) * ImageDigest::BLOCK, total_);
+        size_t n = std::min(end - offset, block_end - offset);
+        hash_.update(buf, n);
+        buf += n;
+        offset += n;
+        if (offset == block_end) {
+            ImageDigest::Digest want, got;
+            size_t index = (block_end - 1) / ImageDigest::BLOCK;
+            // The writer hashes a block before it writes it, so a durable
+            // block without a digest means the digest broke
+            if (!digest_->block(index, want)) {
+                inconclusive_ = true;
+                return false;
+            }
+            hash_.finish(got.data());
+            hash_.reset();
+            if (got != want) {
+                fail(index * ImageDigest::BLOCK);
+                return false;
+            }
+        }
+        verified_.store(offset);
+    }
+    return true;
+}
+
+bool TrailingVerifier::read_range(size_t offset, size_t length) {
+    auto consumer = [this](const char *buf, size_t len, size_t off) { return check(buf, len, off); };
+    if (use_uring_) return uring_read(dfd_, offset, length, CHUNK, DEPTH, consumer, should_stop_);
+    PoolBuffer buf(CHUNK);
+    if (!buf) return false;
+    for (size_t off = offset; off < offset + length; off += CHUNK) {
+        if (should_stop_ && should_stop_()) return false;
+        size_t len = std::min(CHUNK, offset + length - off);
+        if (pread(dfd_, buf.data(), len, (off_t)off) != (ssize_t)len || !consumer(buf.data(), len, off)) return false;
+    }
+    return true;
+}
+
+void TrailingVerifier::run() {
+    size_t next = 0;
+    for (;;) {
+        size_t upto;
+        bool last;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!quit_ && !finishing_ && durable_ - next < window_) {
+                cv_.wait_for(lock, POLL);
+                if (should_stop_ && should_stop_()) return;
+            }
+            if (quit_) return;
+            last = finishing_;
+            upto = last ? total_ : durable_;
+        }
+        if (should_stop_ && should_stop_()) return;
+
+        // O_DIRECT up to the last whole block; the tail of the image comes
+        // through the page cache once its cached copy has been dropped
+        size_t aligned = upto / block_size_ * block_size_;
+        bool ok = aligned <= next || read_range(next, aligned - next);
+        if (ok && aligned > next) next = aligned;
+        if (ok && last && next < total_) {
+            size_t len = total_ - next;
+            char tail[4096];
+            posix_fadvise(fd_, (off_t)next, (off_t)len, POSIX_FADV_DONTNEED);
+            ok = len <= sizeof(tail) && pread(fd_, tail, len, (off_t)next) == (ssize_t)len && check(tail, len, next);
+            if (ok) next = total_;
+        }
+        if (!ok) {
+            if (!failed() && !inconclusive_ && !(should_stop_ && should_stop_())) {
+                std::cerr << "Verify while writing: readback failed at offset " << verified() << std::endl;
+                inconclusive_ = true;
+            }
+            return;
+        }
+        if (last) return;
+    }
+}
@@ -0,0 +1,514 @@
+#include "uring_engine.h"
+#include "buffer_pool.h"
+#include "autotune.h"
+#include <iostream>
+#include <vector>
+#include <map>
+#include <deque>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define BOOTUSB_HAVE_URING 1
+#endif
+
+#ifdef BOOTUSB_HAVE_URING
+
+namespace {
+
+// Minimal raw-syscall ring; we only need READ/WRITE(_FIXED) and a blocking
+// wait, so pulling in liburing is not worth the extra build dependency.
+struct Ring {
+    int fd = -1;
+    unsigned entries = 0;
+    void *sq_ptr = MAP_FAILED;
+    size_t sq_size = 0;
+    void *cq_ptr = MAP_FAILED;
+    size_t cq_size = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    unsigned to_submit = 0;
+
+    ~Ring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+        if (fd >= 0) close(fd);
+    }
+
+    bool init(unsigned depth) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+        if (fd < 0) return false;
+        entries = p.sq_entries;
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) return false;
+        if (single) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) return false;
+        }
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        char *sq = (char *)sq_ptr;
+        sq_head = (unsigned *)(sq + p.sq_off.head);
+        sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned *)(sq + p.sq_off.array);
+        char *cq = (char *)cq_ptr;
+        cq_head = (unsigned *)(cq + p.cq_off.head);
+        cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    int reg(unsigned opcode, const void *arg, unsigned nr) {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+    }
+
+    io_uring_sqe *get_sqe() {
+        unsigned tail = *sq_tail;
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= entries) return nullptr;
+        unsigned idx = tail & *sq_mask;
+        sq_array[idx] = idx;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit;
+        return sqe;
+    }
+
+    // Submit everything queued and block until at least one completion.
+    int submit_and_wait() {
+        for (;;) {
+            int rc = (int)syscall(__NR_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (rc >= 0) {
+                to_submit -= std::min<unsigned>(to_submit, (unsigned)rc);
+                return 0;
+            }
+            if (errno != EINTR) return -errno;
+        }
+    }
+
+    bool peek(io_uring_cqe &out) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        out = cqes[head & *cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+struct Slot {
+    char *buf = nullptr;
+    size_t offset = 0;   // absolute offset of this chunk
+    size_t len = 0;      // bytes in this chunk
+    size_t done = 0;     // bytes of the current phase already transferred
+    bool writing = false;
+    std::chrono::steady_clock::time_point write_start;
+};
+
+// user_data of cancel and timeout requests, never a slot index
+const unsigned long long CANCEL_TAG = ~0ull;
+const unsigned long long TIMEOUT_TAG = ~0ull - 1;
+
+} // namespace
+
+bool uring_engine_available() {
+    Ring ring;
+    return ring.init(1);
+}
+
+bool uring_copy(int ifd, int ofd, size_t total, size_t chunk_size, unsigned queue_depth,
+                std::function<void(size_t, size_t)> progress_callback,
+                unsigned short ioprio, ChunkTuner *tuner, std::function<bool()> should_stop) {
+    const size_t CHUNK = chunk_size > 0 ? chunk_size : 4 * 1024 * 1024;
+    const unsigned DEPTH = std::max(1u, std::min(queue_depth, 64u));
+
+    Ring ring;
+    if (!ring.init(DEPTH)) {
+        std::cerr << "io_uring setup failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::vector<Slot> slots(DEPTH);
+    std::vector<iovec> iovs(DEPTH);
+    bool ok = true;
+    for (unsigned i = 0; i < DEPTH; ++i) {
+        char *p = buffer_pool_acquire(CHUNK);
+        if (!p) { ok = false; break; }
+        slots[i].buf = p;
+        iovs[i].iov_base = p;
+        iovs[i].iov_len = CHUNK;
+    }
+    auto free_slots = [&]() { for (auto &s : slots) buffer_pool_release(s.buf, CHUNK); };
+    if (!ok) {
+        std::cerr << "io_uring buffer allocation failed" << std::endl;
+        free_slots();
+        return false;
+    }
+
+    int fds[2] = { ifd, ofd };
+    bool fixed_files = ring.reg(IORING_REGISTER_FILES, fds, 2) == 0;
+    bool fixed_bufs = ring.reg(IORING_REGISTER_BUFFERS, iovs.data(), DEPTH) == 0;
+    std::cout << "io_uring engine: depth " << DEPTH << ", "
+              << (fixed_bufs ? "registered" : "unregistered") << " buffers, "
+              << (fixed_files ? "fixed" : "plain") << " files" << std::endl;
+
+    auto queue = [&](unsigned i) -> bool {
+        Slot &s = slots[i];
+        io_uring_sqe *sqe = ring.get_sqe();
+        if (!sqe) return false;
+        int file = s.writing ? 1 : 0;
+        if (fixed_files) {
+            sqe->fd = file;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = fds[file];
+        }
+        if (fixed_bufs) {
+            sqe->opcode = s.writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = (__u16)i;
+        } else {
+            sqe->opcode = s.writing ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->addr = (unsigned long long)(uintptr_t)(s.buf + s.done);
+        sqe->len = (unsigned)(s.len - s.done);
+        sqe->off = s.offset + s.done;
+        sqe->ioprio = ioprio;
+        sqe->user_data = i;
+        return true;
+    };
+
+    size_t next_offset = 0;
+    // Writes complete out of order; progress reports only the prefix that is
+    // complete, so callers can flush or checkpoint up to it
+    size_t written = 0;
+    std::map<size_t, size_t> completed;  // offset -> length of finished chunks above written
+    unsigned inflight = 0;
+
+    // With a tuner only tuner->depth() slots cycle at a time; the rest wait here
+    std::vector<unsigned> idle;
+    auto active_limit = [&]() -> unsigned { return tuner ? std::min(tuner->depth(), DEPTH) : DEPTH; };
+
+    auto start_read = [&](unsigned i) -> bool {
+        if (next_offset >= total) return true;
+        if (inflight >= active_limit()) {
+            idle.push_back(i);
+            return true;
+        }
+        Slot &s = slots[i];
+        s.offset = next_offset;
+        s.len = std::min(tuner ? std::min(tuner->chunk(), CHUNK) : CHUNK, total - next_offset);
+        s.done = 0;
+        s.writing = false;
+        next_offset += s.len;
+        if (!queue(i)) return false;
+        ++inflight;
+        return true;
+    };
+
+    for (unsigned i = 0; i < DEPTH && ok; ++i) ok = start_read(i);
+
+    // With should_stop, a timeout request bounds each wait so a stop request
+    // is seen even while every slot waits on a slow device
+    __kernel_timespec poll_interval = { 0, 50 * 1000 * 1000 };
+    bool timeout_pending = false;
+    bool stopped = false;
+
+    while (ok && inflight > 0) {
+        if (should_stop && should_stop()) {
+            stopped = true;
+            ok = false;
+            break;
+        }
+        if (should_stop && !timeout_pending) {
+            io_uring_sqe *sqe = ring.get_sqe();
+            if (sqe) {
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (unsigned long long)(uintptr_t)&poll_interval;
+                sqe->len = 1;
+                sqe->user_data = TIMEOUT_TAG;
+                timeout_pending = true;
+            }
+        }
+        int rc = ring.submit_and_wait();
+        if (rc < 0) {
+            std::cerr << "io_uring submit failed: " << strerror(-rc) << std::endl;
+            ok = false;
+            break;
+        }
+        io_uring_cqe cqe;
+        while (ok && ring.peek(cqe)) {
+            if (cqe.user_data == TIMEOUT_TAG) {
+                timeout_pending = false;
+                continue;
+            }
+            unsigned i = (unsigned)cqe.user_data;
+            Slot &s = slots[i];
+            --inflight;
+            if (cqe.res < 0) {
+                std::cerr << (s.writing ? "Error writing to USB: " : "Error reading ISO: ")
+                          << strerror(-cqe.res) << std::endl;
+                ok = false;
+                break;
+            }
+            if (cqe.res == 0) {
+                std::cerr << (s.writing ? "Error writing to USB: device full" : "Error reading ISO: unexpected end of file") << std::endl;
+                ok = false;
+                break;
+            }
+            s.done += (size_t)cqe.res;
+            if (s.done < s.len) {
+                // Short transfer: resubmit the remainder of the same phase.
+                ok = queue(i);
+                if (ok) ++inflight;
+            } else if (!s.writing) {
+                s.writing = true;
+                s.done = 0;
+                s.write_start = std::chrono::steady_clock::now();
+                ok = queue(i);
+                if (ok) ++inflight;
+            } else {
+                if (tuner) {
+                    tuner->record(s.len, std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - s.write_start).count());
+                }
+                completed[s.offset] = s.len;
+                size_t before = written;
+                while (!completed.empty() && completed.begin()->first == written) {
+                    written += completed.begin()->second;
+                    completed.erase(completed.begin());
+                }
+                if (progress_callback && written != before) progress_callback(written, total);
+                ok = start_read(i);
+                // The tuner may have raised the depth: put parked slots back to work
+                while (ok && !idle.empty() && inflight < active_limit() && next_offset < total) {
+                    unsigned j = idle.back();
+                    idle.pop_back();
+                    ok = start_read(j);
+                }
+            }
+        }
+    }
+
+    // On a stop, ask the kernel to cancel what has not reached the device yet
+    if (stopped) {
+        for (unsigned i = 0; i < DEPTH; ++i) {
+            io_uring_sqe *sqe = ring.get_sqe();
+            if (!sqe) break;
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = i;
+            sqe->user_data = CANCEL_TAG;
+        }
+    }
+
+    // Drain anything still in flight before the buffers go away.
+    while (inflight > 0) {
+        if (ring.submit_and_wait() < 0) break;
+        io_uring_cqe cqe;
+        while (ring.peek(cqe)) {
+            if (cqe.user_data != CANCEL_TAG && cqe.user_data != TIMEOUT_TAG) --inflight;
+        }
+    }
+
+    if (fixed_bufs) ring.reg(IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    free_slots();
+    return ok;
+}
+
+bool uring_read(int fd, size_t offset, size_t length, size_t chunk_size, unsigned queue_depth,
+                const ChunkSink &consumer, std::function<bool()> should_stop, size_t *failed_at) {
+    const size_t CHUNK = chunk_size > 0 ? chunk_size : 1024 * 1024;
+    const unsigned DEPTH = std::max(1u, std::min(queue_depth, 64u));
+
+    Ring ring;
+    if (!ring.init(DEPTH)) {
+        std::cerr << "io_uring setup failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::vector<Slot> slots(DEPTH);
+    std::vector<iovec> iovs(DEPTH);
+    bool ok = true;
+    for (unsigned i = 0; i < DEPTH; ++i) {
+        char *p = buffer_pool_acquire(CHUNK);
+        if (!p) { ok = false; break; }
+        slots[i].buf = p;
+        iovs[i].iov_base = p;
+        iovs[i].iov_len = CHUNK;
+    }
+    auto free_slots = [&]() { for (auto &s : slots) buffer_pool_release(s.buf, CHUNK); };
+    if (!ok) {
+        std::cerr << "io_uring buffer allocation failed" << std::endl;
+        free_slots();
+        return false;
+    }
+    bool fixed_bufs = ring.reg(IORING_REGISTER_BUFFERS, iovs.data(), DEPTH) == 0;
+
+    auto queue = [&](unsigned i) -> bool {
+        Slot &s = slots[i];
+        io_uring_sqe *sqe = ring.get_sqe();
+        if (!sqe) return false;
+        sqe->fd = fd;
+        if (fixed_bufs) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->buf_index = (__u16)i;
+        } else {
+            sqe->opcode = IORING_OP_READ;
+        }
+        sqe->addr = (unsigned long long)(uintptr_t)(s.buf + s.done);
+        sqe->len = (unsigned)(s.len - s.done);
+        sqe->off = s.offset + s.done;
+        sqe->user_data = i;
+        return true;
+    };
+
+    // Slots in offset order; completions arrive in any order but reach the
+    // consumer in this one
+    std::deque<unsigned> order;
+    const size_t end = offset + length;
+    size_t next_offset = offset;
+    unsigned inflight = 0;
+    // A failed chunk is held in order until the chunks ahead of it are delivered
+    std::vector<int> failed(DEPTH, 0);
+    bool any_failed = false;
+    auto start_read = [&](unsigned i) -> bool {
+        if (next_offset >= end || any_failed) return true;
+        Slot &s = slots[i];
+        s.offset = next_offset;
+        s.len = std::min(CHUNK, end - next_offset);
+        s.done = 0;
+        next_offset += s.len;
+        if (!queue(i)) return false;
+        order.push_back(i);
+        ++inflight;
+        return true;
+    };
+    for (unsigned i = 0; i < DEPTH && ok; ++i) ok = start_read(i);
+
+    __kernel_timespec poll_interval = { 0, 50 * 1000 * 1000 };
+    bool timeout_pending = false;
+    while (ok && !order.empty()) {
+        if (should_stop && should_stop()) {
+            ok = false;
+            break;
+        }
+        if (should_stop && !timeout_pending) {
+            io_uring_sqe *sqe = ring.get_sqe();
+            if (sqe) {
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (unsigned long long)(uintptr_t)&poll_interval;
+                sqe->len = 1;
+                sqe->user_data = TIMEOUT_TAG;
+                timeout_pending = true;
+            }
+        }
+        int rc = ring.submit_and_wait();
+        if (rc < 0) {
+            std::cerr << "io_uring submit failed: " << strerror(-rc) << std::endl;
+            ok = false;
+            break;
+        }
+        io_uring_cqe cqe;
+        while (ok && ring.peek(cqe)) {
+            if (cqe.user_data == TIMEOUT_TAG) {
+                timeout_pending = false;
+                continue;
+            }
+            Slot &s = slots[(unsigned)cqe.user_data];
+            --inflight;
+            if (cqe.res <= 0) {
+                failed[(unsigned)cqe.user_data] = cqe.res < 0 ? -cqe.res : -1;
+                any_failed = true;
+                continue;
+            }
+            s.done += (size_t)cqe.res;
+            if (s.done < s.len) {
+                ok = queue((unsigned)cqe.user_data);
+                if (ok) ++inflight;
+            }
+        }
+        // Hand over the completed prefix and reuse its slots
+        while (ok && !order.empty()) {
+            unsigned i = order.front();
+            if (failed[i]) {
+                std::cerr << "Error reading back the device at offset " << slots[i].offset << ": "
+                          << (failed[i] > 0 ? strerror(failed[i]) : "unexpected end of device")
+                          << std::endl;
+                if (failed_at) *failed_at = slots[i].offset;
+                ok = false;
+                break;
+            }
+            if (slots[i].done != slots[i].len) break;
+            order.pop_front();
+            ok = consumer(slots[i].buf, slots[i].len, slots[i].offset) && start_read(i);
+        }
+    }
+
+    if (inflight > 0) {
+        for (unsigned i = 0; i < DEPTH; ++i) {
+            io_uring_sqe *sqe = ring.get_sqe();
+            if (!sqe) break;
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = i;
+            sqe->user_data = CANCEL_TAG;
+        }
+    }
+    while (inflight > 0) {
+        if (ring.submit_and_wait() < 0) break;
+        io_uring_cqe cqe;
+        while (ring.peek(cqe)) {
+            if (cqe.user_data != CANCEL_TAG && cqe.user_data != TIMEOUT_TAG) --inflight;
+        }
+    }
+
+    if (fixed_bufs) ring.reg(IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    free_slots();
+    return ok;
+}
+
+#else
+
+bool uring_engine_available() {
+    return false;
+}
+
+bool uring_copy(int, int, size_t, size_t, unsigned, std::function<void(size_t, size_t)>, unsigned short, ChunkTuner *,
+                std::function<bool()>) {
+    return false;
+}
+
+bool uring_read(int, size_t, size_t, size_t, unsigned, const ChunkSink &, std::function<bool()>, size_t *) {
+    return false;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include <libudev.h>
 #include <iostream>
 #include <sstream>
+#include <initializer_list>
 
 static std::string human_readable_size(unsigned long long sectors) {
     // sectors are usually 512 bytes
@@ -64,4 +65,38 @@ std::vector<USBDevice> list_usb_devices() {
     udev_enumerate_unref(enumerate);
     udev_unref(udev);
     return devices;
-}
\ No newline at end of file
+}
+
+// Value of the first of keys that the block device behind devnode has as a
+// udev property, "" if it has none
+static std::string udev_property(const std::string &devnode, std::initializer_list<const char *> keys) {
+    std::string value;
+    struct udev *udev = udev_new();
+    if (!udev) return value;
+
+    std::string name = devnode.substr(devnode.find_last_of('/') + 1);
+    struct udev_device *dev = udev_device_new_from_subsystem_sysname(udev, "block", name.c_str());
+    if (dev) {
+        for (const char *key : keys) {
+            const char *v = udev_device_get_property_value(dev, key);
+            if (v) {
+                value = v;
+                break;
+            }
+        }
+        udev_device_unref(dev);
+    }
+    udev_unref(udev);
+    return value;
+}
+
+std::string device_model(const std::string &devnode) {
+    std::string model = udev_property(devnode, { "ID_VENDOR" });
+    std::string product = udev_property(devnode, { "ID_MODEL" });
+    if (!product.empty()) model += (model.empty() ? "" : " ") + product;
+    return model;
+}
+
+std::string device_serial(const std::string &devnode) {
+    return udev_property(devnode, { "ID_SERIAL_SHORT", "ID_SERIAL" });
+}
@@ -1,21 +1,338 @@
 #include "write_iso.h"
 #include "bootloader.h"
+#include "uring_engine.h"
+#include "pipeline_engine.h"
+#include "buffer_pool.h"
+#include "io_util.h"
+#include "io_sched.h"
+#include "autotune.h"
+#include "usb_detect.h"
+#include "sparse_write.h"
+#include "delta_write.h"
+#include "write_journal.h"
+#include "bad_sectors.h"
+#include "removal_watch.h"
+#include "job_control.h"
+#include "block_stats.h"
+#include "mapped_source.h"
+#include "numa_place.h"
+#include "image_cache.h"
+#include "image_digest.h"
+#include "readback.h"
+#include "trail_verify.h"
+#include "memscan.h"
+#include "quick_verify.h"
+#include "hash_manifest.h"
 #include <fstream>
 #include <vector>
+#include <set>
 #include <iostream>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstring>
 #include <algorithm>
+#include <chrono>
+#include <climits>
+#include <memory>
+#include <atomic>
+
+static bool verify_impl(const std::string &iso_path, const std::string &usb_path,
+                        std::function<void(size_t, size_t)> progress_callback, bool drop_behind,
+                        const CancelToken *cancel, PauseToken *pause, bool mapped, ByteRanges &mismatches);
+static bool verify_digest(const std::string &iso_path, const std::string &usb_path, const ImageDigest &digest,
+                          std::function<void(size_t, size_t)> progress_callback,
+                          const CancelToken *cancel, PauseToken *pause, ByteRanges &mismatches);
+
+// Journal and hash manifest belong to the stick, not to whichever node it got
+static std::string job_device_id(const std::string &usb_path) {
+    std::string id = device_serial(usb_path);
+    return id.empty() ? usb_path : id;
+}
+
+// A cancellable job never hands the kernel more than this in one request,
+// so the request it is blocked in finishes well inside the cancel budget
+static const size_t CANCEL_SLICE = 1024 * 1024;
+// The final flush reports progress after every FLUSH_STEP bytes reach the device
+static const size_t FLUSH_STEP = 8 * 1024 * 1024;
 
 bool write_iso_to_usb(const std::string &iso_path, const std::string &usb_path, std::function<void(size_t, size_t)> progress_callback) {
     return write_iso_to_usb_advanced(iso_path, usb_path, progress_callback, 4 * 1024 * 1024, false);
 }
 
+// Bounds the dirty page-cache data of a buffered device write: each advance()
+// starts writeback of the newly written range and waits for everything older
+// than the window to reach the device, so the final fsync only drains one window.
+struct WritebackWindow {
+    int fd;
+    size_t window;
+    size_t started = 0;  // writeback initiated up to here
+    size_t waited = 0;   // durable up to here
+    int error = 0;
+    std::function<bool()> stop = nullptr;  // if set, waits go in CANCEL_SLICE steps and end early
+
+    void advance(size_t cursor) {
+        if (window == 0 || error) return;
+        if (cursor > started) {
+            if (sync_file_range(fd, (off_t)started, (off_t)(cursor - started), SYNC_FILE_RANGE_WRITE) != 0) {
+                fail();
+                return;
+            }
+            started = cursor;
+        }
+        if (cursor > waited + window) wait_until(cursor - window);
+    }
+
+    // Wait for everything below upto to reach the device; false if stopped first
+    bool wait_until(size_t upto) {
+        while (waited < upto && !error && window > 0) {
+            if (stop && stop()) return false;
+            size_t step = stop ? std::min(CANCEL_SLICE, upto - waited) : upto - waited;
+            if (sync_file_range(fd, (off_t)waited, (off_t)step,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+                fail();
+                return true;
+            }
+            waited += step;
+        }
+        return true;
+    }
+
+    void fail() {
+        if (errno == EINVAL || errno == ESPIPE || errno == ENOSYS) {
+            // Not supported for this target; fall back to a single final flush
+            std::cerr << "sync_file_range unsupported, disabling writeback window" << std::endl;
+            window = 0;
+        } else {
+            error = errno;
+        }
+    }
+};
+
+// Cache-neutral mode: drops source and device pages behind the write cursor so
+// flashing a multi-GB image does not evict the host's working set, and samples
+// how much page cache the job held before each drop.
+struct CacheDropper {
+    int ifd = -1;
+    int ofd = -1;
+    int probe = -1;              // read-only device fd for mincore(); ofd is write-only
+    bool device_cached = false;  // false for O_DIRECT writes
+    size_t src_dropped = 0;
+    size_t dev_dropped = 0;
+    size_t sampled_at = 0;
+    size_t peak = 0;
+    bool estimated = false;      // mincore() refused: peak is the undropped window size
+
+    // Sampling maps and walks the window, so it runs every SAMPLE_STEP bytes
+    static const size_t SAMPLE_STEP = 16 * 1024 * 1024;
+
+    ~CacheDropper() {
+        if (probe >= 0) close(probe);
+    }
+
+    bool enabled() const { return ifd >= 0; }
+
+    void sample(size_t cursor) {
+        size_t window = cursor - src_dropped;
+        if (device_cached) window += cursor - dev_dropped;
+        ssize_t held = -1;
+        if (!estimated) {
+            held = resident_bytes(ifd, src_dropped, cursor - src_dropped);
+            if (held >= 0 && device_cached) {
+                ssize_t dev = probe >= 0 ? resident_bytes(probe, dev_dropped, cursor - dev_dropped) : -1;
+                held = dev >= 0 ? held + dev : -1;
+            }
+            estimated = held < 0;
+        }
+        peak = std::max(peak, held >= 0 ? (size_t)held : window);
+        sampled_at = cursor;
+    }
+
+    // cursor: bytes written so far; device_clean: prefix already on the device
+    void advance(size_t cursor, size_t device_clean) {
+        if (!enabled()) return;
+        if (cursor - sampled_at >= SAMPLE_STEP) sample(cursor);
+        if (cursor > src_dropped) {
+            posix_fadvise(ifd, (off_t)src_dropped, (off_t)(cursor - src_dropped), POSIX_FADV_DONTNEED);
+            src_dropped = cursor;
+        }
+        if (device_cached && device_clean > dev_dropped) {
+            posix_fadvise(ofd, (off_t)dev_dropped, (off_t)(device_clean - dev_dropped), POSIX_FADV_DONTNEED);
+            dev_dropped = device_clean;
+        }
+    }
+
+    void finish() {
+        if (!enabled()) return;
+        posix_fadvise(ifd, 0, 0, POSIX_FADV_DONTNEED);
+        if (device_cached) posix_fadvise(ofd, 0, 0, POSIX_FADV_DONTNEED);
+        std::cout << "Cache-neutral write: peak page-cache footprint " << (peak / (1024*1024)) << "MB"
+                  << (estimated ? " (estimated, mincore unavailable)" : " (sampled)") << std::endl;
+    }
+};
+
+// Applies an I/O priority to the calling thread for the lifetime of a job
+struct IoPriorityScope {
+    unsigned short value;
+    int previous = -1;
+
+    explicit IoPriorityScope(unsigned short ioprio) : value(ioprio) {
+        if (value == 0) return;
+        previous = set_thread_io_priority(value);
+        if (previous < 0) {
+            std::cerr << "Could not set I/O priority: " << strerror(errno) << std::endl;
+            value = 0;
+        } else {
+            std::cout << "I/O priority class " << (value >> 13) << " level " << (value & 7) << std::endl;
+        }
+    }
+    ~IoPriorityScope() {
+        if (previous >= 0) set_thread_io_priority((unsigned short)previous);
+    }
+};
+
+// Plain read()->write() loop, one chunk in flight at a time. With a tuner the
+// buffer is its largest chunk and each iteration uses the tuner's current size.
+static bool write_serial(int ifd, const ChunkSink &sink, size_t length, size_t BUF,
+                         std::function<void(size_t, size_t)> progress_callback,
+                         ChunkTuner *tuner = nullptr) {
+    PoolBuffer buf(BUF);
+    if (!buf) {
+        std::cerr << "Error allocating write buffer" << std::endl;
+        return false;
+    }
+    size_t written = 0;
+
+    while (written < length) {
+        size_t want = std::min(tuner ? tuner->chunk() : BUF, length - written);
+        ssize_t r = read_full(ifd, buf.data(), want);
+        if (r < 0) { 
+            std::cerr << "Error reading ISO: " << strerror(errno) << std::endl;
+            return false; 
+        }
+        if (r == 0) break;
+        auto write_start = std::chrono::steady_clock::now();
+        if (!sink(buf.data(), (size_t)r, written)) { 
+            std::cerr << "Error writing to USB: " << strerror(errno) << std::endl;
+            return false; 
+        }
+        if (tuner) {
+            tuner->record((size_t)r, std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - write_start).count());
+        }
+        written += (size_t)r;
+        if (progress_callback) progress_callback(written, length);
+    }
+    return true;
+}
+
+// Zero-copy ISO -> device transfer through a pipe; data never enters user
+// space. Falls back to the serial loop if the kernel refuses to splice into
+// the target (e.g. some drivers or O_DIRECT handles return EINVAL).
+static bool write_splice(int ifd, int ofd, size_t length, size_t BUF,
+                         std::function<void(size_t, size_t)> progress_callback,
+                         const std::function<bool()> &should_stop) {
+    ChunkSink sink = [ofd, &should_stop](const char *buf, size_t len, size_t offset) {
+        if (should_stop()) {
+            errno = ECANCELED;
+            return false;
+        }
+        return pwrite_full(ofd, buf, len, offset);
+    };
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC) != 0) {
+        std::cerr << "splice: pipe creation failed, using serial writes" << std::endl;
+        return write_serial(ifd, sink, length, BUF, progress_callback);
+    }
+    // Larger pipes mean fewer round trips; the kernel may cap this at pipe-max-size
+    int pipe_size = fcntl(pfd[1], F_SETPIPE_SZ, (int)std::min(BUF, (size_t)INT_MAX));
+    const size_t step = pipe_size > 0 ? (size_t)pipe_size : 64 * 1024;
+
+    size_t written = 0;
+    size_t reported = 0;
+    bool ok = true;
+    while (ok && written < length) {
+        if (should_stop()) {
+            ok = false;
+            break;
+        }
+        ssize_t in = splice(ifd, nullptr, pfd[1], nullptr, std::min(step, length - written), SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && written == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // Source rejects splice (e.g. a hugetlb-backed cached image)
+            std::cerr << "splice rejected by source (" << strerror(errno) << "), using serial writes" << std::endl;
+            close(pfd[0]);
+            close(pfd[1]);
+            return write_serial(ifd, sink, length, BUF, progress_callback);
+        }
+        if (in <= 0) {
+            std::cerr << "Error reading ISO: " << (in < 0 ? strerror(errno) : "unexpected end of file") << std::endl;
+            ok = false;
+            break;
+        }
+        size_t pending = (size_t)in;
+        while (pending > 0) {
+            ssize_t out = splice(pfd[0], nullptr, ofd, nullptr, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out < 0 && written == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                // Target rejects splice: flush what is already in the pipe by hand
+                // and finish with the serial loop from the current file positions
+                std::cerr << "splice rejected by target (" << strerror(errno) << "), using serial writes" << std::endl;
+                PoolBuffer buf(BUF);
+                ok = buf && read_full(pfd[0], buf.data(), pending) == (ssize_t)pending
+                         && write_full(ofd, buf.data(), pending);
+                if (!ok) {
+                    std::cerr << "Error writing to USB: " << strerror(errno) << std::endl;
+                    break;
+                }
+                written = pending;
+                if (progress_callback) progress_callback(written, length);
+                close(pfd[0]);
+                close(pfd[1]);
+                auto rest_progress = [&](size_t w, size_t) {
+                    if (progress_callback) progress_callback(written + w, length);
+                };
+                auto rest_sink = [&](const char *b, size_t len, size_t offset) {
+                    return sink(b, len, written + offset);
+                };
+                return write_serial(ifd, rest_sink, length - written, BUF, rest_progress);
+            }
+            if (out <= 0) {
+                std::cerr << "Error writing to USB: " << (out < 0 ? strerror(errno) : "device full") << std::endl;
+                ok = false;
+                break;
+            }
+            pending -= (size_t)out;
+            written += (size_t)out;
+        }
+        // Report at the same chunk granularity as the copying engines
+        if (ok && progress_callback && (written - reported >= BUF || written == length)) {
+            reported = written;
+            progress_callback(written, length);
+        }
+    }
+    close(pfd[0]);
+    close(pfd[1]);
+    return ok;
+}
+
 bool write_iso_to_usb_advanced(const std::string &iso_path, const std::string &usb_path, 
                               std::function<void(size_t, size_t)> progress_callback,
-                              size_t buffer_size, bool verify_write) {
+                              size_t buffer_size, bool verify_write,
+                              const std::string &engine, unsigned queue_depth) {
+    WriteOptions options;
+    options.buffer_size = buffer_size;
+    options.verify_write = verify_write;
+    options.engine = engine;
+    options.queue_depth = queue_depth;
+    return write_iso_to_usb_advanced(iso_path, usb_path, progress_callback, options);
+}
+
+bool write_iso_to_usb_advanced(const std::string &iso_path, const std::string &usb_path, 
+                              std::function<void(size_t, size_t)> progress_callback,
+                              const WriteOptions &options) {
+    auto job_start = std::chrono::steady_clock::now();
+
     // Open iso file
     int ifd = open(iso_path.c_str(), O_RDONLY);
     if (ifd < 0) { 
@@ -31,103 +348,964 @@ bool write_iso_to_usb_advanced(const std::string &iso_path, const std::string &u
     }
     size_t total = (size_t)st.st_size;
 
-    // Open usb device
-    int ofd = open(usb_path.c_str(), O_WRONLY | O_SYNC);
+    // With the image cache on, every read below comes from the in-memory copy;
+    // st keeps describing the file for the journal. A load is cancellable
+    // like the write itself.
+    const CancelToken *cancel = options.cancel;
+    int cached = image_cache_open(iso_path, [cancel]() { return cancel && cancel->cancelled(); });
+    if (cached >= 0) {
+        close(ifd);
+        ifd = cached;
+    }
+    if (cancel && cancel->cancelled()) {
+        std::cerr << "Write cancelled before writing, job stopped " << cancel->since_cancel_ms()
+                  << "ms after the request" << std::endl;
+        if (options.report) options.report->cancelled = true;
+        close(ifd);
+        return false;
+    }
+
+    // A regular file, or a new path outside /dev, is an image-file target:
+    // created on demand, written sparsely and verified like a device
+    struct stat tst;
+    bool file_target = stat(usb_path.c_str(), &tst) == 0 ? S_ISREG(tst.st_mode)
+                                                         : errno == ENOENT && usb_path.compare(0, 5, "/dev/") != 0;
+    if (file_target && options.target_size > 0 && options.target_size < total) {
+        std::cerr << "Target size " << options.target_size << " is smaller than the image" << std::endl;
+        close(ifd);
+        return false;
+    }
+    const int create = file_target ? O_CREAT : 0;
+
+    // Open usb device, bypassing the page cache when asked to. Buffered writes
+    // either go through a bounded writeback window or, with no window, O_SYNC.
+    // Error-tolerant writes need each failure to map to the write that caused
+    // it, which rules out deferred writeback errors: they use O_DIRECT, and
+    // O_SYNC only where the target refuses O_DIRECT.
+    bool direct = options.direct_io || options.tolerate_errors;
+    int ofd = -1;
+    if (direct) {
+        ofd = open(usb_path.c_str(), O_WRONLY | O_DIRECT | create, 0644);
+        if (ofd < 0 && errno == EINVAL) {
+            std::cerr << "O_DIRECT not supported on " << usb_path
+                      << (options.tolerate_errors ? ", error-tolerant writes use O_SYNC" : ", using buffered writes")
+                      << std::endl;
+            direct = false;
+        }
+    }
+    bool sync_errors = direct || options.tolerate_errors;
+    WritebackWindow writeback{ -1, sync_errors ? 0 : options.writeback_window };
+    if (!direct) ofd = open(usb_path.c_str(), (writeback.window > 0 ? O_WRONLY : O_WRONLY | O_SYNC) | create, 0644);
     if (ofd < 0) { 
         std::cerr << "Error opening USB device: " << strerror(errno) << std::endl;
         close(ifd); 
         return false; 
     }
 
+    // A pulled stick stops every engine at its next I/O instead of letting
+    // each queued write and the final flush fail on their own
+    RemovalWatch removal(usb_path);
+    auto interrupted = [&removal, cancel]() {
+        return removal.removed() || (cancel && cancel->cancelled());
+    };
+    // So does a mismatch found by a verifier trailing the writer
+    std::unique_ptr<TrailingVerifier> trailing;
+    auto should_stop = [&interrupted, &trailing]() {
+        return interrupted() || (trailing && trailing->failed());
+    };
+
     // Use provided buffer size or default to 4MB
-    const size_t BUF = buffer_size > 0 ? buffer_size : 4 * 1024 * 1024;
-    std::vector<char> buf(BUF);
-    size_t written = 0;
-    ssize_t r;
-    
-    std::cout << "Writing ISO to USB with " << (BUF / (1024*1024)) << "MB buffer..." << std::endl;
-    
-    while ((r = read(ifd, buf.data(), BUF)) > 0) {
-        ssize_t w = write(ofd, buf.data(), r);
-        if (w < 0) { 
-            std::cerr << "Error writing to USB: " << strerror(errno) << std::endl;
-            close(ifd); 
-            close(ofd); 
-            return false; 
+    size_t BUF = options.buffer_size > 0 ? options.buffer_size : 4 * 1024 * 1024;
+
+    // A capped job writes chunks of about 50ms worth of budget, so the device
+    // sees a steady trickle instead of a full chunk every few seconds
+    TokenBucket throttle(options.max_mbps * 1024 * 1024, 0);
+    if (throttle.active()) {
+        size_t paced = (size_t)(options.max_mbps * 1024 * 1024 / 20) / 65536 * 65536;
+        BUF = std::min(BUF, std::max(paced, (size_t)65536));
+        throttle = TokenBucket(options.max_mbps * 1024 * 1024, BUF);
+        std::cout << "Throughput capped at " << options.max_mbps << "MB/s" << std::endl;
+    }
+
+    // The priority is inherited by any helper threads the engines start
+    IoPriorityScope priority(io_priority_value(options.io_class, options.io_level));
+
+    // Before any buffer is allocated or engine thread started, so both land
+    // on the node the target's USB controller is attached to
+    NodePlacement placement(ofd, options.numa_placement);
+
+    // O_DIRECT needs block-aligned lengths and offsets: round the chunk up and
+    // leave the unaligned tail of the image for a buffered write at the end
+    size_t body = total;
+    if (direct) {
+        size_t lbs = logical_block_size(ofd);
+        BUF = (BUF + lbs - 1) / lbs * lbs;
+        body = total - total % lbs;
+        std::cout << "Using O_DIRECT with " << lbs << "-byte logical blocks" << std::endl;
+    } else if (writeback.window > 0) {
+        writeback.fd = ofd;
+        std::cout << "Using buffered writeback with a " << (writeback.window / (1024*1024))
+                  << "MB dirty window" << std::endl;
+    }
+
+    // An interrupted write of the same image to the same stick continues
+    // from its last durable checkpoint
+    std::unique_ptr<WriteJournal> journal;
+    size_t resume = 0;
+    if (options.resume) {
+        journal.reset(new WriteJournal(iso_path, job_device_id(usb_path), total, (long long)st.st_mtime));
+        resume = std::min(journal->resume_point(ifd, usb_path), body);
+        if (direct) resume -= resume % logical_block_size(ofd);
+        if (resume == 0) std::cout << "Resume: no usable checkpoint, writing from the start" << std::endl;
+    }
+
+    // Every write goes through the sink when the engine sees the data
+    size_t device_bytes = 0;
+    // A cancellable job writes in slices and checks for a stop or pause between them
+    ChunkSink sink = [&](const char *buf, size_t len, size_t offset) {
+        size_t slice = cancel || options.pause ? CANCEL_SLICE : len;
+        for (size_t pos = 0; pos < len; pos += slice) {
+            if (options.pause) options.pause->wait(cancel);
+            if (should_stop()) {
+                errno = removal.removed() ? ENODEV : ECANCELED;
+                return false;
+            }
+            size_t n = std::min(slice, len - pos);
+            if (!pwrite_full(ofd, buf + pos, n, offset + pos)) return false;
+            device_bytes += n;
         }
-        written += (size_t)w;
-        if (progress_callback) progress_callback(written, total);
+        return true;
+    };
+
+    std::unique_ptr<RetryWriter> retry;
+    if (options.tolerate_errors) {
+        retry.reset(new RetryWriter(logical_block_size(ofd), sink));
+        sink = [&retry](const char *buf, size_t len, size_t offset) {
+            return retry->write(buf, len, offset);
+        };
+        std::cout << "Error-tolerant writes: failing chunks are bisected and bad blocks mapped" << std::endl;
     }
-    if (r < 0) { 
-        std::cerr << "Error reading ISO: " << strerror(errno) << std::endl;
-        close(ifd); 
-        close(ofd); 
-        return false; 
+
+    // Zero runs of the image become holes in a file target
+    bool sparse_mode = options.sparse || file_target;
+    if (file_target && !prepare_image_file(ofd, ifd, total, options.target_size, options.delta || resume > 0)) {
+        close(ifd);
+        close(ofd);
+        return false;
+    }
+
+    SparseWriter sparse(ofd, sink);
+    if (sparse_mode) {
+        if (!sparse.prepare(total)) {
+            close(ifd);
+            close(ofd);
+            return false;
+        }
+        sink = [&sparse](const char *buf, size_t len, size_t offset) {
+            return sparse.write(buf, len, offset);
+        };
+    }
+    // Delta runs first so unchanged runs never reach the sparse or raw writer
+    int rfd = -1;
+    std::unique_ptr<DeltaWriter> delta;
+    if (options.delta) {
+        rfd = open(usb_path.c_str(), direct ? O_RDONLY | O_DIRECT : O_RDONLY);
+        if (rfd < 0) {
+            std::cerr << "Cannot read target for delta write (" << strerror(errno) << "), writing everything" << std::endl;
+        } else {
+            delta.reset(new DeltaWriter(rfd, sink));
+            sink = [&delta](const char *buf, size_t len, size_t offset) {
+                return delta->write(buf, len, offset);
+            };
+            std::cout << "Delta write: only runs that differ from the target are written" << std::endl;
+        }
+    }
+
+    // Verification compares the device against digests taken as the image
+    // streams past, so the job reads the image only once; the same digests
+    // make the hash manifest. Hashing runs on the reader thread and only
+    // keeps ahead of a fast device on the SHA extensions; without them,
+    // verification compares against the image with the SIMD compare instead.
+    bool hash_image = options.hash_manifest || (options.verify_write && Sha256::accelerated());
+    if (options.verify_write && !hash_image) {
+        std::cout << "No SHA extensions: verifying against the image instead of digests" << std::endl;
+    }
+    std::unique_ptr<ImageDigest> digest;
+    if (hash_image) {
+        digest.reset(new ImageDigest(total));
+        // A resumed job never streams the prefix it skips: hash it here, as a
+        // phase of its own that reports progress and can be stopped
+        if (resume > 0) {
+            std::cout << "Resume: hashing the first " << (resume / (1024*1024)) << "MB of the image for verification"
+                      << std::endl;
+        }
+        PoolBuffer buf(ImageDigest::BLOCK);
+        bool hashed = (bool)buf;
+        for (size_t off = 0; hashed && off < resume; off += ImageDigest::BLOCK) {
+            if (interrupted() || (options.pause && !options.pause->wait(cancel))) break;
+            size_t len = std::min(ImageDigest::BLOCK, resume - off);
+            hashed = pread(ifd, buf.data(), len, (off_t)off) == (ssize_t)len;
+            if (!hashed) break;
+            digest->update(buf.data(), len, off);
+            if (options.status_callback) {
+                WriteProgress status;
+                status.hashing = true;
+                status.handed = off + len;
+                status.total = resume;
+                options.status_callback(status);
+            }
+        }
+        if (interrupted()) {
+            // Reported as a cancel or removal like any other stop
+        } else if (!hashed) {
+            std::cerr << "Error reading ISO while hashing the resumed prefix (" << strerror(errno)
+                      << "), verifying against the image instead of digests" << std::endl;
+            digest.reset();
+        }
+    }
+    if (interrupted()) {
+        if (removal.removed()) std::cerr << "Device removed before writing" << std::endl;
+        if (cancel && cancel->cancelled()) {
+            std::cerr << "Write cancelled before writing, job stopped " << cancel->since_cancel_ms()
+                      << "ms after the request" << std::endl;
+            if (options.report) options.report->cancelled = true;
+        }
+        if (options.report && removal.removed()) options.report->device_removed = true;
+        if (rfd >= 0) close(rfd);
+        close(ifd);
+        close(ofd);
+        return false;
+    }
+
+    // A resumed job engine starts at offset 0 of its range, the sink maps it back
+    if (resume > 0) {
+        ChunkSink inner = sink;
+        sink = [inner, resume](const char *buf, size_t len, size_t offset) {
+            return inner(buf, len, offset + resume);
+        };
+        if (lseek(ifd, (off_t)resume, SEEK_SET) < 0) {
+            std::cerr << "Error seeking ISO: " << strerror(errno) << std::endl;
+            if (rfd >= 0) close(rfd);
+            close(ifd);
+            close(ofd);
+            return false;
+        }
+    }
+
+    // Modes that inspect or hash each chunk, or start mid-image, need an
+    // engine that hands the data to the sink
+    bool inspect = sparse_mode || delta || resume > 0 || retry || digest;
+
+    // Pick the engine: "auto" prefers io_uring, anything unavailable falls back to the serial loop
+    std::string engine = options.engine;
+    if (engine != "auto" && engine != "io_uring" && engine != "serial" && engine != "splice" && engine != "pipeline" &&
+        engine != "mmap") {
+        std::cerr << "Unknown write engine: " << engine << ", using serial writes" << std::endl;
+        engine = "serial";
+    }
+    if (inspect && (engine == "auto" || engine == "io_uring" || engine == "splice")) {
+        if (engine != "auto") std::cout << "Engine " << engine << " does not write through the sink, using pipeline" << std::endl;
+        engine = "pipeline";
+    }
+    bool use_uring = false;
+    if (engine == "io_uring" || engine == "auto") {
+        use_uring = uring_engine_available();
+        if (!use_uring && engine == "io_uring") {
+            std::cerr << "io_uring unavailable, falling back to serial writes" << std::endl;
+        }
+        if (!use_uring) engine = "serial";
+    }
+    // Held until the job returns, so a verify pass shares the same mapping
+    std::shared_ptr<MappedImage> image;
+    if (engine == "mmap") {
+        image = MappedImage::open(ifd, total);
+        if (!image) {
+            std::cerr << "Cannot map the ISO, falling back to serial writes" << std::endl;
+            engine = "serial";
+        }
+    }
+
+    // The pipeline hashes on its reader thread, alongside the writes; the
+    // other sink engines hash in the sink
+    ChunkSink hash_read;
+    if (digest) {
+        hash_read = [&digest, resume](const char *buf, size_t len, size_t offset) {
+            digest->update(buf, len, offset + resume);
+            return true;
+        };
+        if (engine != "pipeline") {
+            ChunkSink inner = sink;
+            sink = [inner, hash_read](const char *buf, size_t len, size_t offset) {
+                hash_read(buf, len, offset);
+                return inner(buf, len, offset);
+            };
+            hash_read = nullptr;
+        }
+    }
+
+    if (options.verify_write && options.verify_window > 0) {
+        trailing.reset(new TrailingVerifier(usb_path, ifd, total, digest.get(), options.verify_window, interrupted));
+        if (trailing->start()) {
+            trailing->durable(resume);
+        } else {
+            trailing.reset();
+        }
+    }
+
+    // io_uring cannot take back a request once the device has it
+    if (use_uring && cancel && BUF > CANCEL_SLICE) {
+        BUF = CANCEL_SLICE;
+        std::cout << "Cancellable job: io_uring requests limited to " << (CANCEL_SLICE / 1024) << "KB" << std::endl;
+    }
+
+    // The autotuner drives chunk size (and io_uring depth); BUF becomes its ceiling
+    std::unique_ptr<ChunkTuner> tuner;
+    bool serial_path = engine == "serial" || engine == "mmap";
+    if (options.autotune) {
+        if (throttle.active()) {
+            std::cout << "Autotune disabled: throughput is capped" << std::endl;
+        } else if (use_uring || serial_path || engine == "pipeline") {
+            unsigned max_depth = use_uring ? (options.queue_depth > 0 ? options.queue_depth : 8) : 1;
+            // Every pipeline ring slot is a full-size buffer, so its ceiling stays lower
+            size_t max_chunk = use_uring ? (cancel ? CANCEL_SLICE : 16 * 1024 * 1024)
+                             : engine == "pipeline" ? 8 * 1024 * 1024 : 32 * 1024 * 1024;
+            tuner.reset(new ChunkTuner(device_model(usb_path), 512 * 1024, max_chunk, max_depth));
+            BUF = max_chunk;
+            std::cout << "Autotuning chunk size" << (use_uring ? " and queue depth" : "") << std::endl;
+        } else {
+            std::cout << "Autotune does not support the " << engine << " engine" << std::endl;
+        }
+    }
+
+    CacheDropper cache;
+    if (options.cache_neutral) {
+        cache.ifd = ifd;
+        cache.ofd = ofd;
+        cache.device_cached = !direct;
+        if (cache.device_cached) cache.probe = open(usb_path.c_str(), O_RDONLY | O_CLOEXEC);
+        posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(ifd, 0, 0, POSIX_FADV_NOREUSE);
+        std::cout << "Cache-neutral mode: dropping source and device pages behind the cursor" << std::endl;
+    }
+
+    // Everything below the resume point is already clean on the device
+    writeback.started = writeback.waited = resume;
+    cache.src_dropped = cache.dev_dropped = cache.sampled_at = resume;
+
+    // Window waits are sliced so a stop request does not sit behind a whole window
+    writeback.stop = should_stop;
+
+    // Progress is what the device has completed, not what write() accepted:
+    // the gap is the dirty or in-flight data the final flush still has to drain
+    CompletionMeter meter(ofd);
+    bool sink_counts = !use_uring && engine != "splice";
+    size_t handed = resume;
+    auto report_progress = [&](bool flushing) {
+        size_t issued = sink_counts ? device_bytes : handed - resume;
+        size_t fallback = (writeback.window > 0 ? std::max(writeback.waited, resume) : handed) - resume;
+        size_t done = std::min(meter.completed(fallback), issued);
+        size_t pending = std::min(issued - done, handed - resume);
+        size_t durable = handed - pending;
+        if (progress_callback) progress_callback(durable, total);
+        if (options.status_callback) {
+            WriteProgress status;
+            status.flushing = flushing;
+            status.durable = durable;
+            status.handed = handed;
+            status.total = total;
+            status.pending = pending;
+            status.mbps = meter.rate() / (1024 * 1024);
+            size_t left = flushing ? pending : total - durable;
+            status.eta_sec = meter.rate() > 0 ? left / meter.rate() : -1;
+            status.verified = trailing ? trailing->verified() : 0;
+            options.status_callback(status);
+        }
+        return pending;
+    };
+
+    size_t paced = resume;
+    size_t cursor = resume;
+    auto body_progress = [&](size_t done, size_t) {
+        size_t written = resume + done;
+        cursor = written;
+        handed = written;
+        throttle.consume(written - paced);
+        paced = written;
+        writeback.advance(written);
+        if (journal && journal->due(written) && writeback.wait_until(written) && !should_stop()) {
+            // Only a flushed prefix may be recorded as durable
+            if (fdatasync(ofd) == 0) journal->checkpoint(ifd, written);
+        }
+        cache.advance(written, writeback.window > 0 ? writeback.waited : written);
+        if (trailing) trailing->durable(writeback.window > 0 ? writeback.waited : written);
+        report_progress(false);
+        // Engines call this between chunks, with their buffers and the device held
+        if (options.pause) options.pause->wait(cancel);
+    };
+    size_t length = body - resume;
+
+    bool ok;
+    long source_major_faults = 0, source_minor_faults = 0;
+    if (use_uring) {
+        const unsigned depth = options.queue_depth > 0 ? options.queue_depth : 8;
+        std::cout << "Writing ISO to USB with " << (BUF / (1024*1024)) << "MB buffer, io_uring queue depth "
+                  << depth << "..." << std::endl;
+        ok = uring_copy(ifd, ofd, length, BUF, depth, body_progress, priority.value, tuner.get(), should_stop);
+        device_bytes = length;
+    } else if (engine == "pipeline") {
+        const unsigned depth = options.queue_depth > 0 ? options.queue_depth : 8;
+        std::cout << "Writing ISO to USB with " << (BUF / (1024*1024)) << "MB buffer, reader/writer ring of "
+                  << depth << "..." << std::endl;
+        ok = pipeline_copy(ifd, sink, length, BUF, depth, body_progress, nullptr, should_stop, hash_read, tuner.get());
+    } else if (engine == "mmap") {
+        std::cout << "Writing ISO to USB from a mapping of the image, " << (BUF / (1024*1024)) << "MB chunks..." << std::endl;
+        FaultCounter faults;
+        ok = mapped_copy(*image, sink, resume, length, BUF, body_progress, tuner.get(), options.cache_neutral);
+        faults.faults(source_major_faults, source_minor_faults);
+    } else if (engine == "splice") {
+        std::cout << "Writing ISO to USB with splice, " << (BUF / (1024*1024)) << "MB progress steps..." << std::endl;
+        ok = write_splice(ifd, ofd, length, BUF, body_progress, should_stop);
+        device_bytes = length;
+    } else {
+        std::cout << "Writing ISO to USB with " << (BUF / (1024*1024)) << "MB buffer..." << std::endl;
+        ok = write_serial(ifd, sink, length, BUF, body_progress, tuner.get());
     }
 
-    fsync(ofd);
+    if (should_stop()) ok = false;
+    if (ok && body < total) {
+        // Unaligned tail: drop O_DIRECT for the last partial block
+        size_t tail = total - body;
+        PoolBuffer buf(BUF);
+        ok = buf && fcntl(ofd, F_SETFL, fcntl(ofd, F_GETFL) & ~O_DIRECT) == 0;
+        ok = ok && pread(ifd, buf.data(), tail, (off_t)body) == (ssize_t)tail;
+        if (ok && digest) digest->update(buf.data(), tail, body);
+        ok = ok && pwrite(ofd, buf.data(), tail, (off_t)body) == (ssize_t)tail;
+        if (!ok) {
+            std::cerr << "Error writing image tail: " << strerror(errno) << std::endl;
+        } else {
+            device_bytes += tail;
+            handed = total;
+        }
+    }
+    auto handoff_time = std::chrono::steady_clock::now();
+    if (ok && writeback.error) {
+        std::cerr << "Error flushing USB writes: " << strerror(writeback.error) << std::endl;
+        ok = false;
+    }
+    bool verified_while_writing = false;
+    if (ok) {
+        // Whatever is left of the window (or the device cache) drains here, as
+        // its own phase: progress keeps moving and the log gives it an ETA
+        auto flush_start = std::chrono::steady_clock::now();
+        size_t pending = report_progress(true);
+        if (pending >= 1024 * 1024) {
+            std::cout << "Flushing " << (pending / (1024*1024)) << "MB to the device";
+            if (meter.rate() > 0) std::cout << ", about " << std::max(1, (int)(pending / meter.rate() + 0.5)) << "s left";
+            std::cout << std::endl;
+        }
+        while (ok && writeback.window > 0 && writeback.waited < total) {
+            ok = writeback.wait_until(std::min(writeback.waited + FLUSH_STEP, total)) && !writeback.error;
+            if (trailing) trailing->durable(writeback.waited);
+            report_progress(true);
+        }
+        if (!ok) {
+            if (writeback.error) std::cerr << "Error flushing USB writes: " << strerror(writeback.error) << std::endl;
+        } else if (fsync(ofd) != 0) {
+            std::cerr << "Error flushing USB device: " << strerror(errno) << std::endl;
+            ok = false;
+        } else if (writeback.window > 0) {
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - flush_start).count();
+            std::cout << "Final flush took " << ms << "ms" << std::endl;
+        }
+        if (ok && trailing) {
+            trailing->durable(total);
+            verified_while_writing = trailing->finish();
+            if (trailing->failed()) ok = false;
+        }
+        if (ok) report_progress(false);
+        if (sparse_mode) sparse.report();
+        if (delta) {
+            std::cout << "Delta write: " << (delta->unchanged() / (1024*1024)) << "MB already matched the image" << std::endl;
+        }
+        cache.finish();
+        if (journal) {
+            if (resume > 0) {
+                std::cout << "Resume: saved rewriting " << (resume / (1024*1024)) << "MB" << std::endl;
+            }
+            journal->complete();
+        }
+    }
+    // The verifier reads ifd when there is no digest
+    if (trailing) trailing->stop();
+    if (rfd >= 0) close(rfd);
     close(ifd);
     close(ofd);
+    if (retry) {
+        retry->report();
+        if (options.report) options.report->bad_ranges = retry->bad_ranges();
+    }
+    if (removal.removed()) {
+        std::cerr << "Device removed at offset " << cursor << " (" << (cursor / (1024*1024))
+                  << "MB written), job stopped " << removal.since_removal_ms()
+                  << "ms after the removal" << std::endl;
+        if (options.report) {
+            options.report->device_removed = true;
+            options.report->removed_at = cursor;
+        }
+        return false;
+    }
+    if (cancel && cancel->cancelled()) {
+        std::cerr << "Write cancelled at offset " << cursor << " (" << (cursor / (1024*1024))
+                  << "MB written), job stopped " << cancel->since_cancel_ms() << "ms after the request" << std::endl;
+        if (options.report) options.report->cancelled = true;
+        return false;
+    }
+    if (trailing && trailing->failed()) {
+        std::cerr << "Write stopped at offset " << cursor << ": the device did not read back the image at offset "
+                  << trailing->failed_at() << std::endl;
+        if (options.report) {
+            options.report->verify_failed = true;
+            options.report->mismatch_at = trailing->failed_at();
+        }
+        return false;
+    }
+    if (!ok) return false;
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - job_start).count();
+    double handoff = std::chrono::duration<double>(handoff_time - job_start).count();
+    std::cout << "Write finished: " << (device_bytes / (1024.0*1024)) << "MB written to the device for a "
+              << (total / (1024*1024)) << "MB image in " << elapsed << "s (all data handed to the kernel after "
+              << handoff << "s)" << std::endl;
+    image_cache_log_stats();
+    if (image) {
+        std::cout << "mmap source: " << source_major_faults << " major / " << source_minor_faults
+                  << " minor page faults while writing" << std::endl;
+    }
+    if (options.report) {
+        options.report->image_bytes = total;
+        options.report->device_bytes = device_bytes;
+        options.report->elapsed_sec = elapsed;
+        options.report->handoff_sec = handoff;
+        options.report->source_major_faults = source_major_faults;
+        options.report->source_minor_faults = source_minor_faults;
+    }
+    if (retry && !retry->bad_ranges().empty()) {
+        std::cerr << "The image is incomplete on the device; consider retiring this stick" << std::endl;
+        return false;
+    }
     
-    // Verify write if requested
-    if (verify_write) {
+    if (digest && digest->complete()) {
+        HashManifest manifest(*digest);
+        std::string path = job_record_path(iso_path, job_device_id(usb_path), total, (long long)st.st_mtime,
+                                           ".manifest");
+        if (manifest.save(path)) {
+            std::cout << "Hash manifest " << manifest.root_hex().substr(0, 16) << " saved for repair" << std::endl;
+        }
+    }
+
+    // Verify write if requested, unless the trailing verifier already has
+    if (options.verify_write && !verified_while_writing) {
         std::cout << "Verifying write..." << std::endl;
-        if (!verify_iso_write(iso_path, usb_path, progress_callback)) {
+        bool verified;
+        ByteRanges local;
+        ByteRanges &mismatches = options.report ? options.report->mismatches : local;
+        if (digest && digest->complete()) {
+            verified = verify_digest(iso_path, usb_path, *digest, progress_callback, cancel, options.pause, mismatches);
+        } else {
+            verified = verify_impl(iso_path, usb_path, progress_callback, options.cache_neutral, cancel, options.pause,
+                                   image != nullptr, mismatches);
+        }
+        if (!verified) {
             std::cerr << "Write verification failed!" << std::endl;
             return false;
         }
         std::cout << "Write verification successful!" << std::endl;
+    } else if (options.quick_verify && !options.verify_write) {
+        QuickVerifyResult result;
+        bool verified = quick_verify(iso_path, usb_path, options.quick_verify_detect, options.quick_verify_fraction,
+                                     options.quick_verify_seed, progress_callback, cancel, &result);
+        if (options.report) {
+            options.report->quick_verify_seed = result.seed;
+            options.report->corrupt_bound = result.corrupt_bound;
+            options.report->mismatches = result.mismatches;
+        }
+        if (!verified) {
+            std::cerr << "Quick verification failed!" << std::endl;
+            return false;
+        }
     }
     
     return true;
 }
 
 bool verify_iso_write(const std::string &iso_path, const std::string &usb_path, 
-                     std::function<void(size_t, size_t)> progress_callback) {
-    // Open both files for verification
+                     std::function<void(size_t, size_t)> progress_callback,
+                     const CancelToken *cancel, PauseToken *pause,
+                     std::vector<std::pair<size_t, size_t>> *mismatches) {
+    ByteRanges local;
+    return verify_impl(iso_path, usb_path, progress_callback, false, cancel, pause, false,
+                       mismatches ? *mismatches : local);
+}
+
+// Differing bytes closer than this are reported as one corrupt extent
+static const size_t MISMATCH_MERGE_GAP = 512;
+
+static void log_mismatches(const ByteRanges &mismatches) {
+    const size_t SHOWN = 16;
+    size_t bytes = 0;
+    for (const auto &r : mismatches) bytes += r.second;
+    std::cerr << "Verification found " << mismatches.size() << " corrupt extent"
+              << (mismatches.size() == 1 ? "" : "s") << ", " << bytes << " bytes in all:" << std::endl;
+    for (size_t i = 0; i < mismatches.size() && i < SHOWN; ++i) {
+        std::cerr << "  offset " << mismatches[i].first << ", " << mismatches[i].second << " bytes" << std::endl;
+    }
+    if (mismatches.size() > SHOWN) std::cerr << "  ... and " << (mismatches.size() - SHOWN) << " more" << std::endl;
+}
+
+// Adds the extents of one chunk to mismatches, which stay in offset order;
+// an extent within MISMATCH_MERGE_GAP of the previous one joins it
+static void add_extents(ByteRanges &mismatches, ByteRanges extents) {
+    std::sort(extents.begin(), extents.end());
+    for (const auto &r : extents) {
+        if (!mismatches.empty()) {
+            auto &last = mismatches.back();
+            size_t last_end = last.first + last.second;
+            if (r.first <= last_end + MISMATCH_MERGE_GAP) {
+                last.second = std::max(last_end, r.first + r.second) - last.first;
+                continue;
+            }
+        }
+        mismatches.push_back(r);
+    }
+}
+
+// Unreadable ranges that read_back() reported for [offset, offset + len),
+// taken off the front of pending. A range running past the end is split
+// there and its remainder stays pending for the next window.
+static ByteRanges take_unreadable(ByteRanges &pending, size_t offset, size_t len) {
+    ByteRanges out;
+    const size_t end = offset + len;
+    while (!pending.empty() && pending.front().first < end) {
+        auto &r = pending.front();
+        if (r.first + r.second > end) {
+            out.push_back({ r.first, end - r.first });
+            r.second -= end - r.first;
+            r.first = end;
+            break;
+        }
+        out.push_back(r);
+        pending.erase(pending.begin());
+    }
+    return out;
+}
+
+static void log_unreadable(size_t bytes) {
+    if (bytes == 0) return;
+    std::cerr << "The device could not read back " << (bytes / 1024) << "KB; those ranges count as corrupt" << std::endl;
+}
+
+static bool verify_impl(const std::string &iso_path, const std::string &usb_path,
+                        std::function<void(size_t, size_t)> progress_callback, bool drop_behind,
+                        const CancelToken *cancel, PauseToken *pause, bool mapped, ByteRanges &mismatches) {
     int ifd = open(iso_path.c_str(), O_RDONLY);
     if (ifd < 0) return false;
 
-    int ofd = open(usb_path.c_str(), O_RDONLY);
-    if (ofd < 0) {
+    struct stat st;
+    if (fstat(ifd, &st) != 0) {
         close(ifd);
         return false;
     }
+    size_t total = (size_t)st.st_size;
+    int cached = image_cache_open(iso_path, [cancel]() { return cancel && cancel->cancelled(); });
+    if (cached >= 0) {
+        close(ifd);
+        ifd = cached;
+    }
 
-    struct stat st;
-    if (fstat(ifd, &st) != 0) {
+    PoolBuffer iso_buf(READBACK_MAX_CHUNK);
+    if (!iso_buf) {
         close(ifd);
-        close(ofd);
         return false;
     }
-    size_t total = (size_t)st.st_size;
 
-    const size_t BUF = 1024 * 1024; // 1MB buffer for verification
-    std::vector<char> iso_buf(BUF);
-    std::vector<char> usb_buf(BUF);
-    size_t verified = 0;
-    ssize_t r1, r2;
+    // Compare against the image mapping instead of reading it into iso_buf
+    std::shared_ptr<MappedImage> image;
+    if (mapped) image = MappedImage::open(ifd, total);
+    size_t prefetched = 0;
+    FaultCounter faults;
 
-    while ((r1 = read(ifd, iso_buf.data(), BUF)) > 0) {
-        r2 = read(ofd, usb_buf.data(), r1);
-        if (r2 != r1) {
-            close(ifd);
-            close(ofd);
-            return false;
+    size_t verified = 0;
+    ByteRanges bad_reads;
+    size_t unreadable = 0;
+    auto compare = [&](const char *dev, size_t len, size_t offset) {
+        if (pause && !pause->wait(cancel)) return false;
+        const char *src;
+        if (image) {
+            src = image->data() + offset;
+            image->read_ahead(offset + len, prefetched);
+            if (!image->fault_in(offset, len)) {
+                std::cerr << "Error reading ISO at offset " << offset << ": the file changed or could not be read"
+                          << std::endl;
+                return false;
+            }
+        } else {
+            if (pread(ifd, iso_buf.data(), len, (off_t)offset) != (ssize_t)len) return false;
+            src = iso_buf.data();
         }
+        // Keeps going past a mismatch to map every corrupt extent; what the
+        // device could not read counts whatever its zero fill compares as
+        ByteRanges found = take_unreadable(bad_reads, offset, len);
+        compare_ranges(src, dev, len, found, offset, MISMATCH_MERGE_GAP);
+        add_extents(mismatches, found);
+        if (drop_behind) {
+            if (image) image->done_with(offset, len);
+            posix_fadvise(ifd, (off_t)offset, len, POSIX_FADV_DONTNEED);
+        }
+        verified = offset + len;
+        if (progress_callback) progress_callback(verified, total);
+        return true;
+    };
+    std::cout << "Comparing with the " << compare_kernel() << " kernel" << std::endl;
+    bool ok = read_back(usb_path, total, compare, [cancel]() { return cancel && cancel->cancelled(); },
+                        [&](size_t offset, size_t len) {
+                            bad_reads.emplace_back(offset, len);
+                            unreadable += len;
+                        });
 
-        if (memcmp(iso_buf.data(), usb_buf.data(), r1) != 0) {
-            close(ifd);
-            close(ofd);
-            return false;
+    close(ifd);
+    if (image) {
+        long major, minor;
+        faults.faults(major, minor);
+        std::cout << "mmap source: " << major << " major / " << minor << " minor page faults while verifying" << std::endl;
+    }
+    if (cancel && cancel->cancelled()) {
+        std::cerr << "Verification cancelled at offset " << verified << std::endl;
+        return false;
+    }
+    log_unreadable(unreadable);
+    if (!mismatches.empty()) log_mismatches(mismatches);
+    return ok && mismatches.empty() && verified == total;
+}
+
+// Compares one block of the image and the device byte by byte, to find the
+// extents behind a digest mismatch; pieces the device cannot read are extents
+// of their own
+static void locate_mismatches(const std::string &iso_path, const std::string &usb_path, size_t offset, size_t len,
+                              ByteRanges &mismatches) {
+    int ifd = open(iso_path.c_str(), O_RDONLY);
+    int dfd = open(usb_path.c_str(), O_RDONLY);
+    PoolBuffer iso_buf(len);
+    PoolBuffer usb_buf(len);
+    // The block was just read with O_DIRECT; make sure this read is not served from the cache either
+    if (dfd >= 0) posix_fadvise(dfd, (off_t)offset, (off_t)len, POSIX_FADV_DONTNEED);
+    if (ifd >= 0 && dfd >= 0 && iso_buf && usb_buf &&
+        pread(ifd, iso_buf.data(), len, (off_t)offset) == (ssize_t)len) {
+        ByteRanges found;
+        for (size_t pos = 0; pos < len; pos += READBACK_SALVAGE_PIECE) {
+            size_t n = std::min(READBACK_SALVAGE_PIECE, len - pos);
+            if (pread(dfd, usb_buf.data() + pos, n, (off_t)(offset + pos)) != (ssize_t)n) {
+                found.emplace_back(offset + pos, n);
+            } else {
+                compare_ranges(iso_buf.data() + pos, usb_buf.data() + pos, n, found, offset + pos, MISMATCH_MERGE_GAP);
+            }
         }
+        add_extents(mismatches, found);
+    } else {
+        // Cannot narrow it down: report the whole block
+        add_extents(mismatches, ByteRanges{ { offset, len } });
+    }
+    if (ifd >= 0) close(ifd);
+    if (dfd >= 0) close(dfd);
+}
+
+// Reads the device back and compares each block's SHA-256 with the digest
+// taken during the write; the image is only read for blocks that differ
+static bool verify_digest(const std::string &iso_path, const std::string &usb_path, const ImageDigest &digest,
+                          std::function<void(size_t, size_t)> progress_callback,
+                          const CancelToken *cancel, PauseToken *pause, ByteRanges &mismatches) {
+    std::cout << "Comparing the device with the image digest " << digest.image_hex() << std::endl;
 
-        verified += r1;
+    size_t total = digest.total();
+    size_t verified = 0;
+    ByteRanges bad_reads;
+    size_t unreadable = 0;
+    Sha256 hash;
+    auto compare = [&](const char *dev, size_t len, size_t offset) {
+        if (pause && !pause->wait(cancel)) return false;
+        // Chunks need not line up with digest blocks
+        while (len > 0) {
+            size_t block_end = std::min((offset / ImageDigest::BLOCK + 1) * ImageDigest::BLOCK, total);
+            size_t n = std::min(len, block_end - offset);
+            hash.update(dev, n);
+            dev += n;
+            len -= n;
+            offset += n;
+            if (offset == block_end) {
+                ImageDigest::Digest d;
+                hash.finish(d.data());
+                hash.reset();
+                size_t index = (block_end - 1) / ImageDigest::BLOCK;
+                size_t start = index * ImageDigest::BLOCK;
+                // A zero-filled unreadable piece can hash right over zeros in the image
+                bool unread = !take_unreadable(bad_reads, start, block_end - start).empty();
+                if (unread || d != digest.blocks()[index]) {
+                    locate_mismatches(iso_path, usb_path, start, block_end - start, mismatches);
+                }
+            }
+        }
+        verified = offset;
         if (progress_callback) progress_callback(verified, total);
+        return true;
+    };
+    // Blocks with unreadable pieces are mapped piece by piece by locate_mismatches()
+    bool ok = read_back(usb_path, total, compare, [cancel]() { return cancel && cancel->cancelled(); },
+                        [&](size_t offset, size_t len) {
+                            bad_reads.emplace_back(offset, len);
+                            unreadable += len;
+                        });
+
+    if (cancel && cancel->cancelled()) {
+        std::cerr << "Verification cancelled at offset " << verified << std::endl;
+        return false;
     }
+    log_unreadable(unreadable);
+    if (!mismatches.empty()) log_mismatches(mismatches);
+    return ok && mismatches.empty() && verified == total;
+}
 
-    close(ifd);
+bool repair_usb(const std::string &iso_path, const std::string &usb_path,
+                std::function<void(size_t, size_t)> progress_callback,
+                const CancelToken *cancel, std::vector<std::pair<size_t, size_t>> *repaired) {
+    auto start = std::chrono::steady_clock::now();
+    int ifd = open(iso_path.c_str(), O_RDONLY);
+    if (ifd < 0) {
+        std::cerr << "Error opening ISO file: " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(ifd, &st) != 0) {
+        std::cerr << "Error getting ISO file stats: " << strerror(errno) << std::endl;
+        close(ifd);
+        return false;
+    }
+    size_t total = (size_t)st.st_size;
+    int cached = image_cache_open(iso_path, [cancel]() { return cancel && cancel->cancelled(); });
+    if (cached >= 0) {
+        close(ifd);
+        ifd = cached;
+    }
+
+    HashManifest manifest;
+    std::string path = job_record_path(iso_path, job_device_id(usb_path), total, (long long)st.st_mtime, ".manifest");
+    if (!manifest.load(path) || manifest.total() != total) {
+        std::cerr << "Repair: no hash manifest of this image for this device; write it again instead" << std::endl;
+        close(ifd);
+        return false;
+    }
+
+    // The stick's own tree, from what it reads back
+    ImageDigest device(total);
+    auto hash = [&](const char *buf, size_t len, size_t offset) {
+        device.update(buf, len, offset);
+        if (progress_callback) progress_callback(offset + len, total);
+        return true;
+    };
+    auto stop = [cancel]() { return cancel && cancel->cancelled(); };
+    // Unreadable sectors are the usual damage on a failing stick: their
+    // blocks are rewritten whatever their zero fill hashes to
+    std::set<size_t> unreadable;
+    auto bad_read = [&unreadable](size_t offset, size_t len) {
+        for (size_t b = offset / HashManifest::BLOCK; b * HashManifest::BLOCK < offset + len; ++b) unreadable.insert(b);
+    };
+    if (!read_back(usb_path, total, hash, stop, bad_read) || !device.complete()) {
+        if (!stop()) std::cerr << "Repair: could not read the device back" << std::endl;
+        close(ifd);
+        return false;
+    }
+    size_t nodes = 0;
+    std::vector<size_t> bad = manifest.differing_blocks(HashManifest(device), &nodes);
+    std::cout << "Repair: " << bad.size() << " of " << manifest.blocks() << " blocks differ (" << nodes
+              << " tree nodes compared)";
+    if (!unreadable.empty()) {
+        std::cout << ", " << unreadable.size() << " could not be read";
+        unreadable.insert(bad.begin(), bad.end());
+        bad.assign(unreadable.begin(), unreadable.end());
+    }
+    std::cout << std::endl;
+    if (bad.empty()) {
+        close(ifd);
+        return true;
+    }
+
+    int ofd = open(usb_path.c_str(), O_RDWR);
+    if (ofd < 0) {
+        std::cerr << "Error opening USB device: " << strerror(errno) << std::endl;
+        close(ifd);
+        return false;
+    }
+    PoolBuffer buf(HashManifest::BLOCK);
+    bool ok = (bool)buf;
+    size_t rewritten = 0;
+    for (size_t index : bad) {
+        if (!ok || stop()) break;
+        size_t offset = index * HashManifest::BLOCK;
+        size_t len = std::min(HashManifest::BLOCK, total - offset);
+        // The image has to still be what the manifest describes
+        ImageDigest::Digest d;
+        if (pread(ifd, buf.data(), len, (off_t)offset) != (ssize_t)len) {
+            std::cerr << "Error reading ISO file: " << strerror(errno) << std::endl;
+            ok = false;
+            break;
+        }
+        Sha256::digest(buf.data(), len, d.data());
+        if (d != manifest.block(index)) {
+            std::cerr << "Repair: the image changed at offset " << offset << " since it was written; write it again"
+                      << std::endl;
+            ok = false;
+            break;
+        }
+        if (pwrite(ofd, buf.data(), len, (off_t)offset) != (ssize_t)len) {
+            std::cerr << "Error writing to USB device at offset " << offset << ": " << strerror(errno) << std::endl;
+            ok = false;
+            break;
+        }
+        rewritten += len;
+        if (repaired) repaired->emplace_back(offset, len);
+    }
+    if (ok && fsync(ofd) != 0) {
+        std::cerr << "Error flushing USB device: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+    // Check the rewritten blocks on the device itself
+    if (ok) flush_and_drop(ofd);
+    int dfd = open(usb_path.c_str(), O_RDONLY | O_DIRECT);
+    if (dfd < 0) dfd = open(usb_path.c_str(), O_RDONLY);
+    for (size_t i = 0; ok && dfd >= 0 && i < bad.size() && !stop(); ++i) {
+        size_t offset = bad[i] * HashManifest::BLOCK;
+        size_t len = std::min(HashManifest::BLOCK, total - offset);
+        // O_DIRECT may refuse the unaligned tail of the image
+        ssize_t r = pread(dfd, buf.data(), len, (off_t)offset);
+        if (r < 0 && errno == EINVAL) r = pread(ofd, buf.data(), len, (off_t)offset);
+        ImageDigest::Digest d;
+        if (r == (ssize_t)len) Sha256::digest(buf.data(), len, d.data());
+        if (r != (ssize_t)len || d != manifest.block(bad[i])) {
+            std::cerr << "Repair: the block at offset " << offset << " still reads back wrong; retire this stick"
+                      << std::endl;
+            ok = false;
+        }
+    }
+    if (dfd >= 0) close(dfd);
     close(ofd);
+    close(ifd);
+    if (stop()) {
+        std::cerr << "Repair cancelled" << std::endl;
+        return false;
+    }
+    if (!ok) return false;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Repair: rewrote " << (rewritten / (1024.0*1024)) << "MB in " << bad.size() << " block"
+              << (bad.size() == 1 ? "" : "s") << ", " << elapsed << "s in total" << std::endl;
     return true;
 }
 
@@ -150,27 +1328,28 @@ bool create_persistent_storage(const std::string &usb_path, size_t size_gb) {
     return true;
 }
 
-bool install_bootloader_advanced(const std::string &usb_path, const std::string &bootloader_type) {
+bool install_bootloader_advanced(const std::string &usb_path, const std::string &bootloader_type,
+                                 const CancelToken *cancel) {
     if (bootloader_type == "None") {
         return true;
     } else if (bootloader_type == "Syslinux") {
-        return install_syslinux(usb_path);
+        return install_syslinux(usb_path, cancel);
     } else if (bootloader_type == "GRUB") {
         // Mount the USB and install GRUB
         std::string mount_point = "/tmp/bootusb_mount";
         std::string cmd = "sudo mkdir -p " + mount_point + " && sudo mount " + usb_path + "1 " + mount_point;
-        int rc = system(cmd.c_str());
+        int rc = run_command(cmd, cancel);
         if (rc != 0) return false;
         
-        cmd = "sudo grub-install --target=i386-pc --boot-directory=" + mount_point + "/boot " + usb_path;
-        rc = system(cmd.c_str());
+        bool installed = install_grub(usb_path, mount_point, cancel);
         
-        system(("sudo umount " + mount_point).c_str());
-        return rc == 0;
+        // Always unmount, also after a cancel
+        run_command("sudo umount " + mount_point, nullptr);
+        return installed;
     } else if (bootloader_type == "Auto-detect") {
         // Try to detect the ISO type and install appropriate bootloader
         // This would require analyzing the ISO file structure
-        return install_syslinux(usb_path); // Default fallback
+        return install_syslinux(usb_path, cancel); // Default fallback
     }
     
     return false;
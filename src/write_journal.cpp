@@ -0,0 +1,163 @@
+#include "write_journal.h"
+#include "sha256.h"
+#include "buffer_pool.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+
+// Flush and record a checkpoint every this many bytes
+static const size_t CHECKPOINT_INTERVAL = 256ull * 1024 * 1024;
+// The tail check covers this many pieces of TAIL_PIECE bytes below a checkpoint
+static const size_t TAIL_PIECES = 4;
+static const size_t TAIL_PIECE = 4 * 1024 * 1024;
+
+static std::string journal_dir() {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    std::string base = xdg && *xdg ? xdg : std::string(home && *home ? home : "/tmp") + "/.cache";
+    return base + "/bootusb/journal";
+}
+
+static void make_dirs(const std::string &dir) {
+    for (size_t pos = 1; pos != std::string::npos; ) {
+        pos = dir.find('/', pos + 1);
+        mkdir(dir.substr(0, pos).c_str(), 0700);
+    }
+}
+
+std::string job_record_path(const std::string &iso_path, const std::string &device_id, size_t image_size,
+                            long long image_mtime, const std::string &suffix) {
+    std::ostringstream key;
+    key << iso_path << '\n' << image_size << '\n' << image_mtime << '\n' << device_id;
+    std::string k = key.str();
+    uint8_t digest[32];
+    Sha256::digest(k.data(), k.size(), digest);
+    make_dirs(journal_dir());
+    return journal_dir() + "/" + Sha256::hex(digest).substr(0, 32) + suffix;
+}
+
+WriteJournal::WriteJournal(const std::string &iso_path, const std::string &device_id, size_t image_size, long long image_mtime)
+    : path_(job_record_path(iso_path, device_id, image_size, image_mtime, ".journal")),
+      iso_path_(iso_path), device_id_(device_id), image_size_(image_size), image_mtime_(image_mtime),
+      next_checkpoint_(CHECKPOINT_INTERVAL) {
+}
+
+// SHA-256 of len bytes at offset, or "" if they cannot be read
+static std::string hash_range(int fd, char *buf, size_t len, size_t offset) {
+    size_t have = 0;
+    while (have < len) {
+        ssize_t r = pread(fd, buf + have, len - have, (off_t)(offset + have));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return "";
+        have += (size_t)r;
+    }
+    uint8_t digest[32];
+    Sha256::digest(buf, len, digest);
+    return Sha256::hex(digest);
+}
+
+size_t WriteJournal::resume_point(int ifd, const std::string &device_path) {
+    std::ifstream in(path_);
+    if (!in) return 0;
+
+    std::string magic, field, iso, device;
+    size_t size = 0, durable = 0;
+    long long mtime = 0;
+    std::vector<ChunkHash> tail;
+    in >> magic;
+    if (magic != "bootusb-journal-1") return 0;
+    while (in >> field) {
+        if (field == "image") {
+            in >> size >> mtime;
+            in.ignore(1);
+            std::getline(in, iso);
+        } else if (field == "device") {
+            in.ignore(1);
+            std::getline(in, device);
+        } else if (field == "durable") {
+            in >> durable;
+        } else if (field == "chunk") {
+            ChunkHash c;
+            in >> c.offset >> c.len >> c.sha;
+            tail.push_back(c);
+        }
+    }
+    if (iso != iso_path_ || device != device_id_ || size != image_size_ || mtime != image_mtime_) return 0;
+    if (durable == 0 || durable > image_size_ || tail.empty()) return 0;
+
+    // Read the device around the page cache: only what reached the stick counts
+    int dfd = open(device_path.c_str(), O_RDONLY | O_DIRECT);
+    if (dfd < 0) dfd = open(device_path.c_str(), O_RDONLY);
+    if (dfd < 0) return 0;
+
+    size_t max_len = 0;
+    for (const auto &c : tail) max_len = std::max(max_len, c.len);
+    size_t buf_size = (max_len + 4095) / 4096 * 4096;
+    PoolBuffer buf(buf_size);
+    bool match = (bool)buf;
+    for (const auto &c : tail) {
+        if (!match) break;
+        match = c.offset + c.len <= durable
+                && hash_range(dfd, buf.data(), c.len, c.offset) == c.sha
+                && hash_range(ifd, buf.data(), c.len, c.offset) == c.sha;
+        if (!match) {
+            std::cout << "Resume: tail check failed at offset " << c.offset << std::endl;
+        }
+    }
+    close(dfd);
+    if (!match) return 0;
+
+    next_checkpoint_ = durable + CHECKPOINT_INTERVAL;
+    std::cout << "Resume: checkpoint at " << (durable / (1024 * 1024))
+              << "MB matches device and image, those bytes are not rewritten" << std::endl;
+    return durable;
+}
+
+bool WriteJournal::checkpoint(int ifd, size_t durable) {
+    // Hash the image below the checkpoint; these pages were just written so
+    // they are normally still cached
+    std::vector<ChunkHash> tail;
+    PoolBuffer buf(TAIL_PIECE);
+    size_t low = durable > TAIL_PIECES * TAIL_PIECE ? durable - TAIL_PIECES * TAIL_PIECE : 0;
+    for (size_t off = low; buf && off < durable; off += TAIL_PIECE) {
+        size_t len = std::min(TAIL_PIECE, durable - off);
+        std::string sha = hash_range(ifd, buf.data(), len, off);
+        if (sha.empty()) return false;
+        tail.push_back(ChunkHash{ off, len, sha });
+    }
+    if (tail.empty()) return false;
+
+    std::string tmp = path_ + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        std::cerr << "Cannot write resume journal " << tmp << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    fprintf(f, "bootusb-journal-1\n");
+    fprintf(f, "image %zu %lld %s\n", image_size_, image_mtime_, iso_path_.c_str());
+    fprintf(f, "device %s\n", device_id_.c_str());
+    fprintf(f, "durable %zu\n", durable);
+    for (const auto &c : tail) fprintf(f, "chunk %zu %zu %s\n", c.offset, c.len, c.sha.c_str());
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path_.c_str()) == 0;
+    if (!ok) {
+        std::cerr << "Cannot write resume journal: " << strerror(errno) << std::endl;
+        return false;
+    }
+    next_checkpoint_ = durable + CHECKPOINT_INTERVAL;
+    return true;
+}
+
+void WriteJournal::complete() {
+    unlink(path_.c_str());
+}